@@ -3,17 +3,68 @@
 // SPDX-FileContributor: Antonio Niño Díaz, 2014, 2019-2020, 2023-2024
 
 #include <ctype.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <stdarg.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "compress.h"
 
 #define MAX_PATH_LEN    2048
 
-char out_array_name[MAX_PATH_LEN];
-char c_file_name[MAX_PATH_LEN];
-char h_file_name[MAX_PATH_LEN];
+// Growable memory buffer where output files are rendered
+typedef struct
+{
+    char *data;
+    size_t len;
+    size_t size;
+} buffer_t;
+
+// Conversion of one input file
+typedef struct
+{
+    const char *path_in;
+    char array_name[MAX_PATH_LEN];
+    char c_file_name[MAX_PATH_LEN];
+    char h_file_name[MAX_PATH_LEN];
+    char s_file_name[MAX_PATH_LEN];
+    size_t size;        // Size of the data in the array
+    size_t uncompressed_size; // Size of the input file if it's compressed
+    buffer_t body;      // Array definition (C) or .incbin block (assembly)
+} job_t;
+
+typedef enum
+{
+    COMPRESSION_NONE,
+    COMPRESSION_LZ77,
+    COMPRESSION_RLE,
+    COMPRESSION_HUFF4,
+    COMPRESSION_HUFF8,
+} compression_t;
+
+// Options
+bool save_ext = true;
+bool asm_out = false;
+bool words = false;
+compression_t compression = COMPRESSION_NONE;
+bool mutable_data = false;
+unsigned int alignment = 4;
+const char *section = NULL; // Section of the array, NULL for the default one
+const char *dir_out;
+const char *combined_name = NULL;
+bool keep_unchanged = false;
+
+job_t *jobs;
+size_t num_jobs;
+
+static size_t next_job;
+static pthread_mutex_t job_lock = PTHREAD_MUTEX_INITIALIZER;
 
 void file_load(const char *path, void **buffer, size_t *size)
 {
@@ -53,11 +104,131 @@ void file_load(const char *path, void **buffer, size_t *size)
     fclose(f);
 }
 
+// Checks if a file contains the concatenation of some buffers
+static bool file_matches(const char *path, const buffer_t *parts, size_t count)
+{
+    struct stat st;
+    size_t total = 0;
+
+    for (size_t i = 0; i < count; i++)
+        total += parts[i].len;
+
+    if ((stat(path, &st) != 0) || !S_ISREG(st.st_mode) || ((size_t)st.st_size != total))
+        return false;
+
+    FILE *f = fopen(path, "rb");
+    if (f == NULL)
+        return false;
+
+    bool same = true;
+    char chunk[16 * 1024];
+
+    for (size_t i = 0; same && (i < count); i++)
+    {
+        for (size_t done = 0; done < parts[i].len; )
+        {
+            size_t n = parts[i].len - done;
+            if (n > sizeof(chunk))
+                n = sizeof(chunk);
+
+            if ((fread(chunk, 1, n, f) != n) ||
+                (memcmp(chunk, &parts[i].data[done], n) != 0))
+            {
+                same = false;
+                break;
+            }
+            done += n;
+        }
+    }
+
+    fclose(f);
+    return same;
+}
+
+// Saves the concatenation of some buffers to a file. With --keep-unchanged, if
+// the file already has the same contents it isn't modified, so that its
+// timestamp doesn't change and the files that depend on it aren't rebuilt.
+//
+// This is opt-in because it breaks the usual assumption of make that the
+// targets of a rule are newer than its prerequisites after running it: rules
+// that list the outputs as targets would run again in every build. The default
+// makefiles use a stamp file as the target of the rule that runs bin2c instead.
+// Also, the .s files generated with --asm don't change when only the data
+// changes (it's included with .incbin), so the objects must depend on the input
+// files too.
+void file_save(const char *path, const buffer_t *parts, size_t count)
+{
+    if (keep_unchanged && file_matches(path, parts, count))
+        return;
+
+    FILE *f = fopen(path, "wb");
+    if (f == NULL)
+    {
+        fprintf(stderr, "Can't open %s for writing\n", path);
+        exit(1);
+    }
+
+    for (size_t i = 0; i < count; i++)
+    {
+        if (fwrite(parts[i].data, 1, parts[i].len, f) != parts[i].len)
+        {
+            fprintf(stderr, "Error while writing %s\n", path);
+            exit(1);
+        }
+    }
+
+    if (fclose(f) != 0)
+    {
+        fprintf(stderr, "Error while writing %s\n", path);
+        exit(1);
+    }
+}
+
+// Makes sure that there are at least "n" free bytes at the end of the buffer
+// and returns a pointer to them.
+static char *buf_reserve(buffer_t *b, size_t n)
+{
+    if (b->len + n > b->size)
+    {
+        size_t size = b->size ? b->size * 2 : 4096;
+        while (size < b->len + n)
+            size *= 2;
+
+        char *data = realloc(b->data, size);
+        if (data == NULL)
+        {
+            fprintf(stderr, "Out of memory\n");
+            exit(1);
+        }
+        b->data = data;
+        b->size = size;
+    }
+
+    return &b->data[b->len];
+}
+
+static void buf_printf(buffer_t *b, const char *fmt, ...)
+{
+    va_list ap;
+
+    va_start(ap, fmt);
+    int len = vsnprintf(NULL, 0, fmt, ap);
+    va_end(ap);
+
+    // vsnprintf() writes the terminator, but it's not part of the length
+    char *p = buf_reserve(b, len + 1);
+
+    va_start(ap, fmt);
+    vsnprintf(p, len + 1, fmt, ap);
+    va_end(ap);
+
+    b->len += len;
+}
+
 // Converts a file name to an array name and output file names
-void generate_transformed_name(const char *_path, const char *dir_out,
-                               bool save_ext)
+void generate_transformed_name(job_t *job, const char *dir_out, bool save_ext)
 {
-    char *path = strdup(_path);
+    char *path = strdup(job->path_in);
     if (path == NULL)
     {
         fprintf(stderr, "Can't allocate memory");
@@ -92,15 +263,17 @@ void generate_transformed_name(const char *_path, const char *dir_out,
 
     const char *basename = &(path[start]);
 
-    len = snprintf(c_file_name, sizeof(c_file_name), "%s/%s.c", dir_out, basename);
-    if (len < 0 || len >= (int) sizeof(c_file_name))
+    len = snprintf(job->c_file_name, sizeof(job->c_file_name), "%s/%s.c",
+                   dir_out, basename);
+    if (len < 0 || len >= (int) sizeof(job->c_file_name))
     {
         fprintf(stderr, "Output file name too long\n");
         exit(1);
     }
 
-    // h_file_name will be the same length as c_file_name.
-    snprintf(h_file_name, sizeof(h_file_name), "%s/%s.h", dir_out, basename);
+    // h_file_name and s_file_name will be the same length as c_file_name.
+    snprintf(job->h_file_name, sizeof(job->h_file_name), "%s/%s.h", dir_out, basename);
+    snprintf(job->s_file_name, sizeof(job->s_file_name), "%s/%s.s", dir_out, basename);
 
     // Fix names of header and C files and replace '.bin' by '_bin'.
     //
@@ -109,13 +282,14 @@ void generate_transformed_name(const char *_path, const char *dir_out,
     {
         for (int i = len - 3; i > 0; i--)
         {
-            if (h_file_name[i] == '.')
+            if (job->h_file_name[i] == '.')
             {
-                h_file_name[i] = '_';
-                c_file_name[i] = '_';
+                job->h_file_name[i] = '_';
+                job->c_file_name[i] = '_';
+                job->s_file_name[i] = '_';
                 break;
             }
-            else if (h_file_name[i] == '/')
+            else if (job->h_file_name[i] == '/')
             {
                 break;
             }
@@ -134,9 +308,9 @@ void generate_transformed_name(const char *_path, const char *dir_out,
         if (isdigit(path[start]))
             prefix = "_";
 
-        len = snprintf(out_array_name, sizeof(out_array_name), "%s%s",
+        len = snprintf(job->array_name, sizeof(job->array_name), "%s%s",
                prefix, &(path[start]));
-        if (len < 0 || len >= (int) sizeof(out_array_name))
+        if (len < 0 || len >= (int) sizeof(job->array_name))
         {
             fprintf(stderr, "Output array name too long\n");
             exit(1);
@@ -144,24 +318,567 @@ void generate_transformed_name(const char *_path, const char *dir_out,
 
         for (int i = 0; i < len; i++)
         {
-            if (!isalnum(out_array_name[i]))
-                out_array_name[i] = '_';
+            if (!isalnum(job->array_name[i]))
+                job->array_name[i] = '_';
         }
     }
 
     free(path);
 }
 
+// Sets the section of the arrays. The short names refer to the memory regions
+// defined in the linker script of the ARM9 (sys/crts/ds_arm9.ld). Data in the
+// "twl" region is only loaded on DSi.
+static bool set_section(const char *name)
+{
+    if (strcmp(name, "itcm") == 0)
+    {
+        section = ".itcm";
+    }
+    else if (strcmp(name, "dtcm") == 0)
+    {
+        section = ".dtcm";
+    }
+    else if (strcmp(name, "twl") == 0)
+    {
+        section = mutable_data ? ".twl.data" : ".twl.rodata";
+    }
+    else
+    {
+        // The name is copied to the C and assembly files as it is
+        if (name[0] == '\0')
+            return false;
+
+        for (const char *c = name; *c != '\0'; c++)
+        {
+            if (!isalnum((unsigned char)*c) && (*c != '.') && (*c != '_'))
+                return false;
+        }
+
+        section = name;
+    }
+
+    return true;
+}
+
+// Returns the qualifier and attributes of the definition of an array
+static const char *c_qualifier(void)
+{
+    return mutable_data ? "" : "const ";
+}
+
+static void c_attributes(char *str, size_t size)
+{
+    if (section == NULL)
+        snprintf(str, size, "__attribute__((aligned(%u)))", alignment);
+    else
+        snprintf(str, size, "__attribute__((aligned(%u), section(\"%s\")))",
+                 alignment, section);
+}
+
+// Longest line generated by the writers (12 bytes or 6 words)
+#define OUT_LINE_MAX        96
+
+static const char hex_digits[] = "0123456789ABCDEF";
+
+// "0xAB, " for every possible byte
+static char byte_token[256][6];
+
+static void init_tokens(void)
+{
+    for (int i = 0; i < 256; i++)
+    {
+        memcpy(byte_token[i], (char[6]){ '0', 'x', hex_digits[i >> 4],
+                                         hex_digits[i & 15], ',', ' ' }, 6);
+    }
+}
+
+// Writes the data as a C array of bytes, 12 bytes per line
+static void write_c_bytes(job_t *job, const uint8_t *data)
+{
+    buffer_t *b = &job->body;
+    size_t size = job->size;
+    char attr[MAX_PATH_LEN + 64];
+
+    c_attributes(attr, sizeof(attr));
+    buf_printf(b, "%suint8_t %s[%zu] %s  =\n",
+               c_qualifier(), job->array_name, size, attr);
+    buf_printf(b, "{\n");
+
+    // Lines are rendered straight into the buffer
+    buf_reserve(b, (size + 11) / 12 * OUT_LINE_MAX);
+
+    for (size_t i = 0; i < size; i += 12)
+    {
+        size_t n = (size - i < 12) ? size - i : 12;
+        char *p = &b->data[b->len];
+
+        memcpy(p, "    ", 4);
+        p += 4;
+        for (size_t j = 0; j < n; j++)
+        {
+            memcpy(p, byte_token[data[i + j]], 6);
+            p += 6;
+        }
+
+        // Replace the ", " of the last token. The last line has no comma.
+        if (i + n == size)
+            p -= 2;
+        else
+            p--;
+        *p++ = '\n';
+
+        b->len = p - b->data;
+    }
+
+    buf_printf(b, "};\n");
+}
+
+// Writes the data as a C array of little-endian 32-bit words, 6 words per
+// line. The array is aliased by a byte array with the expected name, so the
+// header is the same as in byte mode.
+static void write_c_words(job_t *job, const uint8_t *data)
+{
+    buffer_t *b = &job->body;
+    size_t size = job->size;
+    size_t words = (size + 3) / 4;
+    char attr[MAX_PATH_LEN + 64];
+
+    c_attributes(attr, sizeof(attr));
+    buf_printf(b,
+        "static %sunion\n"
+        "{\n"
+        "    uint32_t words[%zu];\n"
+        "    uint8_t bytes[%zu];\n"
+        "} %s_data %s =\n"
+        "{\n"
+        "  {\n",
+        c_qualifier(), words, size, job->array_name, attr);
+
+    buf_reserve(b, (words + 5) / 6 * OUT_LINE_MAX);
+
+    for (size_t i = 0; i < words; i += 6)
+    {
+        size_t n = (words - i < 6) ? words - i : 6;
+        char *p = &b->data[b->len];
+
+        memcpy(p, "    ", 4);
+        p += 4;
+        for (size_t j = 0; j < n; j++)
+        {
+            const uint8_t *w = &data[(i + j) * 4];
+            size_t left = size - (i + j) * 4;
+
+            *p++ = '0';
+            *p++ = 'x';
+            // Most significant byte first. Bytes past the end are zero.
+            for (int k = 3; k >= 0; k--)
+            {
+                uint8_t v = ((size_t)k < left) ? w[k] : 0;
+                *p++ = hex_digits[v >> 4];
+                *p++ = hex_digits[v & 15];
+            }
+            *p++ = ',';
+            *p++ = ' ';
+        }
+
+        if (i + n == words)
+            p -= 2;
+        else
+            p--;
+        *p++ = '\n';
+
+        b->len = p - b->data;
+    }
+
+    buf_printf(b,
+        "  }\n"
+        "};\n"
+        "\n"
+        "extern %suint8_t %s[%zu] __attribute__((alias(\"%s_data\")));\n",
+        c_qualifier(), job->array_name, size, job->array_name);
+}
+
+// Writes a block of assembly that defines the array. Uncompressed files are
+// included with .incbin, so that the compiler doesn't need to parse a huge
+// array. The symbol is the same as in the C file, so the header is valid for
+// both.
+static void write_s_block(job_t *job, const uint8_t *data)
+{
+    buffer_t *b = &job->body;
+    const char *name = job->array_name;
+
+    if (section == NULL)
+        buf_printf(b, "    .section %s\n", mutable_data ? ".data" : ".rodata");
+    else
+        buf_printf(b, "    .section %s, \"%s\", %%progbits\n", section,
+                   mutable_data ? "aw" : "a");
+
+    buf_printf(b,
+        "    .balign %u\n"
+        "    .global %s\n"
+        "    .type %s, \"object\"\n"
+        "    .size %s, %zu\n"
+        "%s:\n",
+        alignment, name, name, name, job->size, name);
+
+    if (job->uncompressed_size != 0)
+    {
+        // The compressed data only exists in memory
+        for (size_t i = 0; i < job->size; i += 12)
+        {
+            size_t n = (job->size - i < 12) ? job->size - i : 12;
+            char *p = buf_reserve(b, OUT_LINE_MAX);
+
+            memcpy(p, "    .byte ", 10);
+            p += 10;
+            for (size_t j = 0; j < n; j++)
+            {
+                memcpy(p, byte_token[data[i + j]], 6);
+                p += 6;
+            }
+            p[-2] = '\n';
+            b->len = p - 1 - b->data;
+        }
+        return;
+    }
+
+    // The path is written as given so that the output doesn't depend on the
+    // directory of the build. The assembler looks for it in the directory it
+    // runs from and in the directories passed with -I.
+    buf_printf(b, "    .incbin \"");
+
+    for (const char *c = job->path_in; *c != '\0'; c++)
+    {
+        if ((*c == '"') || (*c == '\\'))
+            buf_printf(b, "\\");
+        buf_printf(b, "%c", *c);
+    }
+
+    buf_printf(b, "\"\n");
+}
+
+static const char c_preamble[] =
+    "// Autogenerated file. Do not edit.\n"
+    "\n"
+    "#include <stdint.h>\n"
+    "\n";
+
+static const char s_preamble[] =
+    "/* Autogenerated file. Do not edit. */\n"
+    "\n";
+
+static const char h_preamble[] =
+    "// Autogenerated file. Do not edit.\n"
+    "\n"
+    "#pragma once\n"
+    "\n"
+    "#include <stdint.h>\n"
+    "\n";
+
+// Adds the declarations of a converted file to a header
+static void write_h_decls(buffer_t *b, const job_t *job)
+{
+    buf_printf(b,
+        "#define %s_size (%zu)\n"
+        "extern %suint8_t %s[%zu];\n",
+        job->array_name, job->size,
+        c_qualifier(), job->array_name, job->size);
+
+    if (job->uncompressed_size != 0)
+    {
+        buf_printf(b, "#define %s_uncompressed_size (%zu)\n",
+                   job->array_name, job->uncompressed_size);
+    }
+}
+
+static buffer_t buf_const(const char *str)
+{
+    return (buffer_t){ (char *)str, strlen(str), 0 };
+}
+
+// Converts one input file. The output files are saved right away unless all
+// files are combined into one output.
+static void convert(job_t *job)
+{
+    void *file = NULL;
+
+    file_load(job->path_in, &file, &job->size);
+
+    if (compression != COMPRESSION_NONE)
+    {
+        uint8_t *data = NULL;
+        size_t size = 0;
+
+        if (job->size > COMPRESS_MAX_SIZE)
+        {
+            fprintf(stderr, "%s is too big to be compressed\n", job->path_in);
+            exit(1);
+        }
+
+        if (compression == COMPRESSION_LZ77)
+            data = compress_lz77(file, job->size, &size);
+        else if (compression == COMPRESSION_RLE)
+            data = compress_rle(file, job->size, &size);
+        else if (compression == COMPRESSION_HUFF8)
+            data = compress_huffman(file, job->size, 8, &size);
+
+        if ((data == NULL) && (compression == COMPRESSION_HUFF8))
+        {
+            fprintf(stderr, "Warning: The Huffman tree of %s doesn't fit with "
+                    "8-bit symbols, using 4-bit symbols\n", job->path_in);
+        }
+
+        if ((data == NULL) && (compression >= COMPRESSION_HUFF4))
+            data = compress_huffman(file, job->size, 4, &size);
+
+        if (data == NULL)
+        {
+            fprintf(stderr, "Can't compress %s\n", job->path_in);
+            exit(1);
+        }
+
+        free(file);
+        file = data;
+        job->uncompressed_size = job->size;
+        job->size = size;
+    }
+
+    if (asm_out)
+        write_s_block(job, file);
+    else if (words)
+        write_c_words(job, file);
+    else
+        write_c_bytes(job, file);
+
+    free(file);
+
+    if (combined_name != NULL)
+        return;
+
+    buffer_t parts[2] = { buf_const(asm_out ? s_preamble : c_preamble), job->body };
+    file_save(asm_out ? job->s_file_name : job->c_file_name, parts, 2);
+
+    buffer_t h = { 0 };
+    buf_printf(&h, "%s", h_preamble);
+    write_h_decls(&h, job);
+    file_save(job->h_file_name, &h, 1);
+    free(h.data);
+
+    free(job->body.data);
+    job->body = (buffer_t){ 0 };
+}
+
+static void *worker(void *arg)
+{
+    (void)arg;
+
+    while (1)
+    {
+        pthread_mutex_lock(&job_lock);
+        size_t i = next_job++;
+        pthread_mutex_unlock(&job_lock);
+
+        if (i >= num_jobs)
+            break;
+
+        convert(&jobs[i]);
+    }
+
+    return NULL;
+}
+
+// Writes the output files of combined mode, with all files in input order
+static void write_combined(void)
+{
+    job_t all;
+
+    all.path_in = combined_name;
+    generate_transformed_name(&all, dir_out, true);
+
+    buffer_t *parts = malloc((num_jobs * 2 + 1) * sizeof(buffer_t));
+    if (parts == NULL)
+    {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+
+    parts[0] = buf_const(asm_out ? s_preamble : c_preamble);
+    for (size_t i = 0; i < num_jobs; i++)
+    {
+        parts[i * 2 + 1] = jobs[i].body;
+        parts[i * 2 + 2] = buf_const(i + 1 < num_jobs ? "\n" : "");
+    }
+    file_save(asm_out ? all.s_file_name : all.c_file_name, parts, num_jobs * 2 + 1);
+    free(parts);
+
+    buffer_t h = { 0 };
+    buf_printf(&h, "%s", h_preamble);
+    for (size_t i = 0; i < num_jobs; i++)
+        write_h_decls(&h, &jobs[i]);
+    file_save(all.h_file_name, &h, 1);
+    free(h.data);
+}
+
+static void add_input(const char *path)
+{
+    static size_t max_jobs;
+
+    if (num_jobs == max_jobs)
+    {
+        max_jobs = max_jobs ? max_jobs * 2 : 64;
+        jobs = realloc(jobs, max_jobs * sizeof(job_t));
+        if (jobs == NULL)
+        {
+            fprintf(stderr, "Out of memory\n");
+            exit(1);
+        }
+    }
+
+    job_t *job = &jobs[num_jobs++];
+    memset(job, 0, sizeof(job_t));
+    job->path_in = path;
+}
+
+static int compare_names(const void *a, const void *b)
+{
+    return strcmp(*(const char **)a, *(const char **)b);
+}
+
+static int compare_jobs(const void *a, const void *b)
+{
+    return strcmp((*(const job_t **)a)->array_name,
+                  (*(const job_t **)b)->array_name);
+}
+
+// Adds all files of a directory, sorted by name. Subdirectories and hidden
+// files are ignored.
+static void add_directory(const char *path)
+{
+    DIR *dir = opendir(path);
+    if (dir == NULL)
+    {
+        fprintf(stderr, "Can't open directory %s\n", path);
+        exit(1);
+    }
+
+    char **names = NULL;
+    size_t count = 0, max = 0;
+    struct dirent *ent;
+
+    while ((ent = readdir(dir)) != NULL)
+    {
+        if (ent->d_name[0] == '.')
+            continue;
+
+        size_t len = strlen(path) + strlen(ent->d_name) + 2;
+        char *full = malloc(len);
+        if (full == NULL)
+        {
+            fprintf(stderr, "Out of memory\n");
+            exit(1);
+        }
+        snprintf(full, len, "%s/%s", path, ent->d_name);
+
+        struct stat st;
+        if (stat(full, &st) != 0 || !S_ISREG(st.st_mode))
+        {
+            free(full);
+            continue;
+        }
+
+        if (count == max)
+        {
+            max = max ? max * 2 : 64;
+            names = realloc(names, max * sizeof(char *));
+            if (names == NULL)
+            {
+                fprintf(stderr, "Out of memory\n");
+                exit(1);
+            }
+        }
+        names[count++] = full;
+    }
+
+    closedir(dir);
+
+    qsort(names, count, sizeof(char *), compare_names);
+    for (size_t i = 0; i < count; i++)
+        add_input(names[i]);
+
+    free(names);
+}
+
+static void add_path(const char *path)
+{
+    struct stat st;
+
+    if (stat(path, &st) == 0 && S_ISDIR(st.st_mode))
+        add_directory(path);
+    else
+        add_input(path);
+}
+
+// Adds all paths listed in a file, one per line. Empty lines are ignored.
+static void add_list(const char *list)
+{
+    FILE *f = fopen(list, "r");
+    if (f == NULL)
+    {
+        fprintf(stderr, "Can't open %s for reading\n", list);
+        exit(1);
+    }
+
+    char line[MAX_PATH_LEN];
+    while (fgets(line, sizeof(line), f) != NULL)
+    {
+        size_t len = strlen(line);
+        while ((len > 0) && ((line[len - 1] == '\n') || (line[len - 1] == '\r')))
+            line[--len] = '\0';
+
+        if (len == 0)
+            continue;
+
+        char *path = strdup(line);
+        if (path == NULL)
+        {
+            fprintf(stderr, "Out of memory\n");
+            exit(1);
+        }
+        add_path(path);
+    }
+
+    fclose(f);
+}
+
 void print_help(const char *path)
 {
     fprintf(stderr, "Invalid arguments.\n"
                     "\n"
                     "Usage:\n"
-                    "    %s [--noext] file_in folder_out\n"
+                    "    %s [options] file_in [file_in ...] folder_out\n"
+                    "\n"
+                    "Inputs may be files or directories. All files of a directory are converted.\n"
                     "\n"
                     "Options:\n"
-                    "    --noext  Remove original extension from output\n"
-                    "    -V       Print version string and exit\n",
+                    "    --noext            Remove original extension from output\n"
+                    "    --asm              Generate a .s file that uses .incbin instead of a .c file\n"
+                    "                       (the input path is saved as given, so assemble it from\n"
+                    "                       the same directory or pass the directory with -I)\n"
+                    "    --u32              Write the C array as 32-bit words (faster to compile)\n"
+                    "    --lz77             Compress data with LZ77 (BIOS format, VRAM-safe)\n"
+                    "    --rle              Compress data with RLE (BIOS format)\n"
+                    "    --huff4, --huff8   Compress data with Huffman (BIOS format, 4/8-bit symbols)\n"
+                    "    --section <name>   Place arrays in itcm, dtcm, twl (DSi only) or section <name>\n"
+                    "    --align <bytes>    Alignment of arrays, a power of two (default: 4)\n"
+                    "    --mutable          Don't make arrays const\n"
+                    "    --list <file>      Convert the files listed in <file>, one per line\n"
+                    "    --combine <name>   Write all arrays to <name>.c (or .s) and <name>.h\n"
+                    "    --keep-unchanged   Don't rewrite outputs that have the same contents. Make\n"
+                    "                       rules should use a stamp file as target, and objects\n"
+                    "                       built from --asm files must also depend on the inputs\n"
+                    "    -j <threads>       Number of files converted in parallel (default: CPUs)\n"
+                    "    -V                 Print version string and exit\n",
                     path);
 
     exit(EXIT_FAILURE);
@@ -175,106 +892,162 @@ void print_version(void)
 
 int main(int argc, char **argv)
 {
-    void *file = NULL;
-    size_t size;
-
     if (argc < 2)
         print_help(argv[0]);
 
     if ((argc == 2) && (strcmp(argv[1], "-V") == 0))
         print_version();
 
-    bool save_ext;
-    const char *path_in;
-    const char *dir_out;
+    long threads = sysconf(_SC_NPROCESSORS_ONLN);
+    const char *section_name = NULL;
 
-    if (strcmp(argv[1], "--noext") == 0)
+    int arg = 1;
+    while ((arg < argc) && (argv[arg][0] == '-'))
     {
-        save_ext = false;
-
-        if (argc < 4)
+        if (strcmp(argv[arg], "--noext") == 0)
+        {
+            save_ext = false;
+        }
+        else if (strcmp(argv[arg], "--asm") == 0)
+        {
+            asm_out = true;
+        }
+        else if (strcmp(argv[arg], "--keep-unchanged") == 0)
+        {
+            keep_unchanged = true;
+        }
+        else if (strcmp(argv[arg], "--u32") == 0)
+        {
+            words = true;
+        }
+        else if (strcmp(argv[arg], "--lz77") == 0)
+        {
+            compression = COMPRESSION_LZ77;
+        }
+        else if (strcmp(argv[arg], "--rle") == 0)
+        {
+            compression = COMPRESSION_RLE;
+        }
+        else if (strcmp(argv[arg], "--huff4") == 0)
+        {
+            compression = COMPRESSION_HUFF4;
+        }
+        else if (strcmp(argv[arg], "--huff8") == 0)
+        {
+            compression = COMPRESSION_HUFF8;
+        }
+        else if ((strcmp(argv[arg], "--section") == 0) && (arg + 1 < argc))
+        {
+            section_name = argv[++arg];
+        }
+        else if ((strcmp(argv[arg], "--align") == 0) && (arg + 1 < argc))
+        {
+            long value = atol(argv[++arg]);
+            if ((value < 4) || (value > 65536) || ((value & (value - 1)) != 0))
+            {
+                fprintf(stderr, "Alignment must be a power of two between 4 and 65536\n");
+                return 1;
+            }
+            alignment = value;
+        }
+        else if (strcmp(argv[arg], "--mutable") == 0)
+        {
+            mutable_data = true;
+        }
+        else if ((strcmp(argv[arg], "--list") == 0) && (arg + 1 < argc))
+        {
+            add_list(argv[++arg]);
+        }
+        else if ((strcmp(argv[arg], "--combine") == 0) && (arg + 1 < argc))
+        {
+            combined_name = argv[++arg];
+        }
+        else if ((strcmp(argv[arg], "-j") == 0) && (arg + 1 < argc))
+        {
+            threads = atol(argv[++arg]);
+        }
+        else
+        {
             print_help(argv[0]);
+        }
 
-        path_in = argv[2];
-        dir_out = argv[3];
+        arg++;
     }
-    else
+
+    // The name of the section of "twl" depends on --mutable
+    if ((section_name != NULL) && !set_section(section_name))
     {
-        save_ext = true;
+        fprintf(stderr, "Invalid section name: %s\n", section_name);
+        return 1;
+    }
 
-        if (argc < 3)
-            print_help(argv[0]);
+    // The last argument is the output folder
+    if (arg >= argc)
+        print_help(argv[0]);
+    dir_out = argv[argc - 1];
 
-        path_in = argv[1];
-        dir_out = argv[2];
-    }
+    for (; arg < argc - 1; arg++)
+        add_path(argv[arg]);
 
-    file_load(path_in, &file, &size);
+    if (num_jobs == 0)
+        print_help(argv[0]);
 
-    generate_transformed_name(path_in, dir_out, save_ext);
+    for (size_t i = 0; i < num_jobs; i++)
+        generate_transformed_name(&jobs[i], dir_out, save_ext);
 
-    FILE *fc = fopen(c_file_name, "w");
-    if (fc == NULL)
+    // Two inputs with the same name would overwrite each other's output or
+    // define the same symbol twice.
+    const job_t **by_name = malloc(num_jobs * sizeof(job_t *));
+    if (by_name == NULL)
     {
-        fprintf(stderr, "Can't open %s for writing\n", c_file_name);
+        fprintf(stderr, "Out of memory\n");
         return 1;
     }
-
-    const char *c_header =
-        "// Autogenerated file. Do not edit.\n"
-        "\n"
-        "#include <stdint.h>\n"
-        "\n";
-
-    fprintf(fc, "%s", c_header);
-    fprintf(fc, "const uint8_t %s[%zu] __attribute__((aligned(4)))  =\n",
-            out_array_name, size);
-    fprintf(fc, "{\n");
-
-    uint8_t *data = file;
-
-    for (size_t i = 0; i < size; i++)
+    for (size_t i = 0; i < num_jobs; i++)
+        by_name[i] = &jobs[i];
+    qsort(by_name, num_jobs, sizeof(job_t *), compare_jobs);
+    for (size_t i = 1; i < num_jobs; i++)
     {
-        if ((i % 12) == 0)
-            fprintf(fc, "    ");
-
-        fprintf(fc, "0x%02X", *data);
-        data++;
-
-        if (i == size - 1)
-            fprintf(fc, "\n");
-        else if ((i % 12) == 11)
-            fprintf(fc, ",\n");
-        else
-            fprintf(fc, ", ");
+        if (strcmp(by_name[i - 1]->array_name, by_name[i]->array_name) == 0)
+        {
+            fprintf(stderr, "%s and %s have the same name\n",
+                    by_name[i - 1]->path_in, by_name[i]->path_in);
+            return 1;
+        }
     }
+    free(by_name);
 
-    fprintf(fc, "};\n");
+    init_tokens();
 
-    fclose(fc);
+    if (threads < 1)
+        threads = 1;
+    if ((size_t)threads > num_jobs)
+        threads = num_jobs;
 
-    FILE *fh = fopen(h_file_name, "w");
-    if (fh == NULL)
+    pthread_t *tids = malloc((threads - 1) * sizeof(pthread_t) + 1);
+    if (tids == NULL)
     {
-        fprintf(stderr, "Can't open %s for writing\n", h_file_name);
+        fprintf(stderr, "Out of memory\n");
         return 1;
     }
 
-    fprintf(fh,
-        "// Autogenerated file. Do not edit.\n"
-        "\n"
-        "#pragma once\n"
-        "\n"
-        "#include <stdint.h>\n"
-        "\n"
-        "#define %s_size (%zu)\n"
-        "extern const uint8_t %s[%zu];\n",
-        out_array_name, size,
-        out_array_name, size);
+    // The main thread works as one of the workers
+    long started = 0;
+    for (; started < threads - 1; started++)
+    {
+        if (pthread_create(&tids[started], NULL, worker, NULL) != 0)
+            break;
+    }
 
-    fclose(fh);
+    worker(NULL);
 
-    free(file);
+    for (long i = 0; i < started; i++)
+        pthread_join(tids[i], NULL);
+
+    free(tids);
+
+    if (combined_name != NULL)
+        write_combined();
 
     return 0;
 }
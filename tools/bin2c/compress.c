@@ -0,0 +1,508 @@
+// SPDX-License-Identifier: CC0-1.0
+//
+// SPDX-FileContributor: Antonio Niño Díaz, 2026
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "compress.h"
+
+static void write_header(uint8_t *dst, uint8_t type, size_t size)
+{
+    dst[0] = type;
+    dst[1] = size & 0xFF;
+    dst[2] = (size >> 8) & 0xFF;
+    dst[3] = (size >> 16) & 0xFF;
+}
+
+static size_t align4(size_t size)
+{
+    return (size + 3) & ~(size_t)3;
+}
+
+// LZ77
+// ----
+
+#define LZ_MIN_LEN      3
+#define LZ_MAX_LEN      18
+#define LZ_MIN_DISP     2   // A displacement of 1 doesn't work in VRAM
+#define LZ_MAX_DISP     4096
+#define LZ_HASH_BITS    16
+
+static uint32_t lz_hash(const uint8_t *p)
+{
+    uint32_t v = (p[0] << 16) | (p[1] << 8) | p[2];
+    return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+uint8_t *compress_lz77(const uint8_t *src, size_t size, size_t *out_size)
+{
+    if (size > COMPRESS_MAX_SIZE)
+        return NULL;
+
+    // Longest match at each position, found with hash chains
+    uint8_t *len = calloc(size + 1, 1);
+    uint16_t *disp = calloc(size + 1, sizeof(uint16_t));
+    int32_t *prev = malloc((size + 1) * sizeof(int32_t));
+    int32_t *head = malloc((1 << LZ_HASH_BITS) * sizeof(int32_t));
+    // Cost in bits of the rest of the input from each position
+    uint64_t *cost = malloc((size + 1) * sizeof(uint64_t));
+    uint8_t *dst = malloc(4 + size + (size + 7) / 8 + 4);
+
+    if (!len || !disp || !prev || !head || !cost || !dst)
+    {
+        free(dst);
+        dst = NULL;
+        goto end;
+    }
+
+    for (size_t i = 0; i < (1 << LZ_HASH_BITS); i++)
+        head[i] = -1;
+
+    for (size_t i = 0; i + LZ_MIN_LEN <= size; i++)
+    {
+        uint32_t h = lz_hash(&src[i]);
+        size_t max = (size - i < LZ_MAX_LEN) ? size - i : LZ_MAX_LEN;
+
+        for (int32_t j = head[h]; j >= 0; j = prev[j])
+        {
+            size_t d = i - j;
+            if (d > LZ_MAX_DISP)
+                break;
+            if (d < LZ_MIN_DISP)
+                continue;
+
+            size_t l = 0;
+            while ((l < max) && (src[j + l] == src[i + l]))
+                l++;
+
+            if (l > len[i])
+            {
+                len[i] = l;
+                disp[i] = d;
+                if (l == max)
+                    break;
+            }
+        }
+
+        prev[i] = head[h];
+        head[h] = i;
+    }
+
+    // Optimal parse: a literal costs 9 bits and a match costs 17 bits
+    cost[size] = 0;
+    for (size_t i = size; i-- > 0; )
+    {
+        uint64_t best = cost[i + 1] + 9;
+        uint8_t best_len = 0;
+
+        for (size_t l = LZ_MIN_LEN; l <= len[i]; l++)
+        {
+            if (cost[i + l] + 17 < best)
+            {
+                best = cost[i + l] + 17;
+                best_len = l;
+            }
+        }
+
+        cost[i] = best;
+        len[i] = best_len;
+    }
+
+    write_header(dst, 0x10, size);
+
+    size_t out = 4;
+    size_t flags = 0;
+    int item = 8;
+
+    for (size_t i = 0; i < size; )
+    {
+        if (item == 8)
+        {
+            flags = out++;
+            dst[flags] = 0;
+            item = 0;
+        }
+
+        if (len[i] != 0)
+        {
+            size_t v = ((len[i] - LZ_MIN_LEN) << 12) | (disp[i] - 1);
+            dst[flags] |= 0x80 >> item;
+            dst[out++] = v >> 8;
+            dst[out++] = v & 0xFF;
+            i += len[i];
+        }
+        else
+        {
+            dst[out++] = src[i++];
+        }
+
+        item++;
+    }
+
+    while (out & 3)
+        dst[out++] = 0;
+
+    *out_size = out;
+
+end:
+    free(len);
+    free(disp);
+    free(prev);
+    free(head);
+    free(cost);
+    return dst;
+}
+
+// RLE
+// ---
+
+#define RLE_MIN_RUN     3
+#define RLE_MAX_RUN     130
+#define RLE_MAX_COPY    128
+
+static size_t rle_flush(uint8_t *dst, size_t out, const uint8_t *src, size_t len)
+{
+    while (len > 0)
+    {
+        size_t n = (len < RLE_MAX_COPY) ? len : RLE_MAX_COPY;
+
+        dst[out++] = n - 1;
+        memcpy(&dst[out], src, n);
+        out += n;
+        src += n;
+        len -= n;
+    }
+
+    return out;
+}
+
+uint8_t *compress_rle(const uint8_t *src, size_t size, size_t *out_size)
+{
+    if (size > COMPRESS_MAX_SIZE)
+        return NULL;
+
+    uint8_t *dst = malloc(align4(4 + size + (size + RLE_MAX_COPY - 1) / RLE_MAX_COPY));
+    if (dst == NULL)
+        return NULL;
+
+    write_header(dst, 0x30, size);
+
+    size_t out = 4;
+    size_t copy_start = 0; // Start of the bytes that will be copied as they are
+
+    for (size_t i = 0; i < size; )
+    {
+        size_t run = 1;
+        while ((i + run < size) && (run < RLE_MAX_RUN) && (src[i + run] == src[i]))
+            run++;
+
+        if (run < RLE_MIN_RUN)
+        {
+            i++;
+            continue;
+        }
+
+        out = rle_flush(dst, out, &src[copy_start], i - copy_start);
+        dst[out++] = 0x80 | (run - RLE_MIN_RUN);
+        dst[out++] = src[i];
+
+        i += run;
+        copy_start = i;
+    }
+
+    out = rle_flush(dst, out, &src[copy_start], size - copy_start);
+
+    while (out & 3)
+        dst[out++] = 0;
+
+    *out_size = out;
+    return dst;
+}
+
+// Huffman
+// -------
+
+typedef struct
+{
+    uint64_t freq;
+    int child[2];       // -1 in leaves
+    int symbol;
+    int address;        // Address of the node in the tree table
+    uint64_t code;
+    int code_len;
+} huff_node;
+
+typedef struct
+{
+    int node;
+    int slot;           // Pair of the tree table that contains the node
+} huff_pending;
+
+static int huff_internal_children(const huff_node *nodes, int n)
+{
+    int count = 0;
+    for (int i = 0; i < 2; i++)
+    {
+        if (nodes[nodes[n].child[i]].child[0] >= 0)
+            count++;
+    }
+    return count;
+}
+
+// Sets the addresses of all nodes in the tree table. Every table entry has a
+// 6-bit field with the offset to the pair of its children, so the pair of the
+// children of a node must be at most 64 pairs after the pair of the node. Pairs
+// are placed one by one, and the nodes that make fewer nodes wait for a pair
+// are placed first if that doesn't make any other node miss its limit.
+// Returns the number of pairs, or -1 if the tree doesn't fit.
+static int huff_layout(huff_node *nodes, int root)
+{
+    huff_pending pending[256];
+    int count = 1;
+
+    // The root is at address 1, which belongs to the "pair" before the first
+    pending[0] = (huff_pending){ root, -1 };
+    nodes[root].address = 1;
+
+    int slot = 0;
+    while (count > 0)
+    {
+        // Pending nodes are sorted by limit. If one is removed, the ones
+        // before it must still fit in the next slots, and the ones after it
+        // get one more slot.
+        bool ok_before[257], ok_after[257];
+
+        ok_before[0] = true;
+        for (int i = 0; i < count; i++)
+            ok_before[i + 1] = ok_before[i] && (pending[i].slot + 64 >= slot + 1 + i);
+
+        ok_after[count] = true;
+        for (int i = count - 1; i >= 0; i--)
+            ok_after[i] = ok_after[i + 1] && (pending[i].slot + 64 >= slot + i);
+
+        int pick = -1;
+        int pick_internal = 3;
+        for (int i = 0; i < count; i++)
+        {
+            if (pending[i].slot + 64 < slot)
+                return -1;
+            if (!ok_before[i] || !ok_after[i + 1])
+                continue;
+
+            int internal = huff_internal_children(nodes, pending[i].node);
+            if (internal < pick_internal)
+            {
+                pick = i;
+                pick_internal = internal;
+            }
+        }
+        if (pick < 0)
+            return -1;
+
+        int n = pending[pick].node;
+        memmove(&pending[pick], &pending[pick + 1],
+                (count - pick - 1) * sizeof(huff_pending));
+        count--;
+
+        for (int i = 0; i < 2; i++)
+        {
+            int c = nodes[n].child[i];
+            nodes[c].address = 2 + slot * 2 + i;
+            if (nodes[c].child[0] >= 0)
+                pending[count++] = (huff_pending){ c, slot };
+        }
+
+        slot++;
+    }
+
+    return slot;
+}
+
+static void huff_codes(huff_node *nodes, int n, uint64_t code, int len)
+{
+    nodes[n].code = code;
+    nodes[n].code_len = len;
+
+    if (nodes[n].child[0] < 0)
+        return;
+
+    huff_codes(nodes, nodes[n].child[0], code << 1, len + 1);
+    huff_codes(nodes, nodes[n].child[1], (code << 1) | 1, len + 1);
+}
+
+// Writes the entries of a node and all its children in the tree table
+static void huff_write_table(const huff_node *nodes, int n, uint8_t *table)
+{
+    const huff_node *node = &nodes[n];
+
+    if (node->child[0] < 0)
+    {
+        table[node->address] = node->symbol;
+        return;
+    }
+
+    const huff_node *c0 = &nodes[node->child[0]];
+    const huff_node *c1 = &nodes[node->child[1]];
+
+    uint8_t value = (c0->address - (node->address & ~1) - 2) / 2;
+    if (c0->child[0] < 0)
+        value |= 0x80;
+    if (c1->child[0] < 0)
+        value |= 0x40;
+    table[node->address] = value;
+
+    huff_write_table(nodes, node->child[0], table);
+    huff_write_table(nodes, node->child[1], table);
+}
+
+uint8_t *compress_huffman(const uint8_t *src, size_t size, int bits,
+                          size_t *out_size)
+{
+    if ((size > COMPRESS_MAX_SIZE) || ((bits != 4) && (bits != 8)))
+        return NULL;
+
+    int symbols = 1 << bits;
+    huff_node nodes[512];
+    memset(nodes, 0, sizeof(nodes));
+
+    for (int i = 0; i < symbols; i++)
+    {
+        nodes[i].child[0] = nodes[i].child[1] = -1;
+        nodes[i].symbol = i;
+    }
+
+    for (size_t i = 0; i < size; i++)
+    {
+        if (bits == 8)
+        {
+            nodes[src[i]].freq++;
+        }
+        else
+        {
+            nodes[src[i] & 0xF].freq++;
+            nodes[src[i] >> 4].freq++;
+        }
+    }
+
+    // Only symbols that are used are part of the tree. The tree needs at least
+    // two leaves, so add an unused symbol if needed.
+    bool used[512] = { false };
+    int free_nodes = 0;
+    for (int i = 0; i < symbols; i++)
+    {
+        if (nodes[i].freq > 0)
+        {
+            used[i] = true;
+            free_nodes++;
+        }
+    }
+    for (int i = 0; free_nodes < 2; i++)
+    {
+        if (!used[i])
+        {
+            used[i] = true;
+            free_nodes++;
+        }
+    }
+
+    // Join the two nodes with the lowest frequencies until one is left
+    int num_nodes = symbols;
+    while (free_nodes > 1)
+    {
+        int a = -1, b = -1;
+        for (int i = 0; i < num_nodes; i++)
+        {
+            if (!used[i])
+                continue;
+            if ((a < 0) || (nodes[i].freq < nodes[a].freq))
+            {
+                b = a;
+                a = i;
+            }
+            else if ((b < 0) || (nodes[i].freq < nodes[b].freq))
+            {
+                b = i;
+            }
+        }
+
+        huff_node *n = &nodes[num_nodes];
+        n->freq = nodes[a].freq + nodes[b].freq;
+        n->child[0] = a;
+        n->child[1] = b;
+        used[a] = used[b] = false;
+        used[num_nodes] = true;
+        num_nodes++;
+        free_nodes--;
+    }
+
+    int root = num_nodes - 1;
+
+    int pairs = huff_layout(nodes, root);
+    if (pairs < 0)
+        return NULL;
+
+    huff_codes(nodes, root, 0, 0);
+
+    uint64_t total_bits = 0;
+    for (int i = 0; i < symbols; i++)
+        total_bits += nodes[i].freq * nodes[i].code_len;
+
+    // The bitstream must start at a multiple of 4 bytes
+    if ((pairs & 1) == 0)
+        pairs++;
+
+    size_t table_size = 2 + pairs * 2;
+    size_t max_size = 4 + table_size + (total_bits + 31) / 32 * 4;
+    uint8_t *dst = calloc(max_size, 1);
+    if (dst == NULL)
+        return NULL;
+
+    write_header(dst, 0x20 | bits, size);
+
+    uint8_t *table = &dst[4];
+    table[0] = pairs;
+    huff_write_table(nodes, root, table);
+
+    // Bits are stored in 32-bit little-endian words, starting from bit 31
+    size_t out = 4 + table_size;
+    uint32_t word = 0;
+    int word_bits = 0;
+
+    for (size_t i = 0; i < size * 8 / bits; i++)
+    {
+        int symbol;
+        if (bits == 8)
+            symbol = src[i];
+        else
+            symbol = (i & 1) ? src[i / 2] >> 4 : src[i / 2] & 0xF;
+
+        const huff_node *n = &nodes[symbol];
+        for (int b = n->code_len - 1; b >= 0; b--)
+        {
+            word = (word << 1) | ((n->code >> b) & 1);
+            if (++word_bits == 32)
+            {
+                dst[out++] = word & 0xFF;
+                dst[out++] = (word >> 8) & 0xFF;
+                dst[out++] = (word >> 16) & 0xFF;
+                dst[out++] = word >> 24;
+                word_bits = 0;
+            }
+        }
+    }
+
+    if (word_bits > 0)
+    {
+        word <<= 32 - word_bits;
+        dst[out++] = word & 0xFF;
+        dst[out++] = (word >> 8) & 0xFF;
+        dst[out++] = (word >> 16) & 0xFF;
+        dst[out++] = word >> 24;
+    }
+
+    *out_size = out;
+    return dst;
+}
@@ -0,0 +1,34 @@
+// SPDX-License-Identifier: CC0-1.0
+//
+// SPDX-FileContributor: Antonio Niño Díaz, 2026
+
+#ifndef COMPRESS_H__
+#define COMPRESS_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Compressors for the formats supported by the decompression functions of the
+// BIOS of the GBA/DS. All of them start with a 32-bit header with the type of
+// compression and the uncompressed size (up to 16 MiB - 1). The size of the
+// output is padded to a multiple of 4 bytes.
+//
+// All functions return a buffer allocated with malloc() and write its size to
+// "out_size". They return NULL if the input is too big or on error.
+
+#define COMPRESS_MAX_SIZE   0xFFFFFF
+
+// LZ77 (type 0x10). Matches never copy from the previous byte, so the result
+// can be decompressed to VRAM as well as to WRAM.
+uint8_t *compress_lz77(const uint8_t *src, size_t size, size_t *out_size);
+
+// Run-length encoding (type 0x30)
+uint8_t *compress_rle(const uint8_t *src, size_t size, size_t *out_size);
+
+// Huffman (type 0x20) with 4-bit or 8-bit symbols. The tree of 8-bit symbols
+// can't always be stored in the format used by the BIOS. In that case this
+// returns NULL and the caller may try with 4-bit symbols.
+uint8_t *compress_huffman(const uint8_t *src, size_t size, int bits,
+                          size_t *out_size);
+
+#endif // COMPRESS_H__
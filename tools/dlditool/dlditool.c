@@ -13,6 +13,7 @@
 #include <stdarg.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <pthread.h>
 
 #define DLDITOOL_VERSION VERSION_STRING
 
@@ -44,6 +45,9 @@ typedef unsigned char data_t;
 
 #define EXIT_NO_DLDI_SECTION	2
 
+// Size of the reads done while looking for the DLDI section of an application
+#define SCAN_CHUNK_SIZE	(1024 * 1024)
+
 enum DldiOffsets {
 	DO_magicString = 0x00,			// "\xED\xA5\x8D\xBF Chishm"
 	DO_magicToken = 0x00,			// 0xBF8DA5ED
@@ -82,13 +86,23 @@ const char dldiFileExtension[] = ".dldi";
 
 void printUsage (char* programName) {
 	printf ("Usage:\n");
-	printf ("%s <dldi> <app>\n", programName);
+	printf ("%s [-f <fixups>] <dldi> <app>\n", programName);
+	printf ("%s -b <list> [-j <threads>] [-f <fixups>]\n", programName);
+	printf ("%s -c <fixups>\n", programName);
 	printf ("   <dldi>        the dldi patch file to apply\n");
 	printf ("   <app>         the application binary to apply the patch to\n");
+	printf ("   -b <list>     apply all patches in <list>, one per line:\n");
+	printf ("                 <dldi><TAB><app>[<TAB><output>]\n");
+	printf ("                 if <output> is present <app> is copied there and\n");
+	printf ("                 the copy is patched\n");
+	printf ("   -j <threads>  number of patches applied at the same time\n");
+	printf ("   -f <fixups>   save the list of relocated words of all patches\n");
+	printf ("   -c <fixups>   check that the applications in a fixup list\n");
+	printf ("                 haven't changed since they were patched\n");
 	return;
 }
 
-addr_t readAddr (data_t *mem, addr_t offset) {
+addr_t readAddr (const data_t *mem, addr_t offset) {
 	return (addr_t)( 
 			(mem[offset + 0] << 0) |
 			(mem[offset + 1] << 8) |
@@ -128,24 +142,65 @@ bool stringStartsWith (const char *str, const char *start) {
 	return (strstr (str, start) == str);
 }
 
-addr_t quickFind (const data_t* data, const data_t* search, size_t dataLen, size_t searchLen) {
-	const int32_t* dataChunk = (const int32_t*) data;
-	int searchChunk = ((const int32_t*)search)[0];
-	addr_t i;
-	addr_t dataChunkEnd = (addr_t)(dataLen / sizeof(int32_t));
+// Looks for the DLDI section of an application. Only word-aligned positions are
+// checked. The file is read in chunks so that the memory used doesn't depend on
+// the size of the file. Returns -1 if there is no DLDI section and -2 on error.
+addr_t findDldiSection (FILE *file, const data_t* search, size_t searchLen) {
+	// Bytes kept from the end of a chunk so that the search string can cross
+	// the boundary between two chunks. It's a multiple of the word size.
+	size_t overlap = (searchLen + 3) & ~(size_t)3;
+	size_t carry = 0;
+	size_t filePos = 0;		// Position in the file of the start of the buffer
+	addr_t result = -1;
+	data_t *buffer;
+
+	buffer = (data_t*) malloc (SCAN_CHUNK_SIZE + overlap);
+	if (!buffer) {
+		return -2;
+	}
 
-	for ( i = 0; i < dataChunkEnd; i++) {
-		if (dataChunk[i] == searchChunk) {
-			if ((i*sizeof(int32_t) + searchLen) > dataLen) {
-				return -1;
-			}
-			if (memcmp (&data[i*sizeof(int32_t)], search, searchLen) == 0) {
-				return i*sizeof(int32_t);
+	fseek (file, 0, SEEK_SET);
+
+	while (result < 0) {
+		size_t readLen = fread (&buffer[carry], 1, SCAN_CHUNK_SIZE, file);
+		size_t len = carry + readLen;
+		bool last = (readLen < SCAN_CHUNK_SIZE);
+		// In the last chunk every position is checked. In other chunks, the
+		// ones that overlap with the next chunk are checked in the next one.
+		size_t end = last ? len : len - overlap;
+		size_t i;
+
+		for (i = 0; (i < end) && (i + searchLen <= len); i += sizeof(int32_t)) {
+			if ((buffer[i] == search[0]) && (memcmp (&buffer[i], search, searchLen) == 0)) {
+				result = (addr_t)(filePos + i);
+				break;
 			}
 		}
+
+		if (ferror (file)) {
+			result = -2;
+			break;
+		}
+		if (last) {
+			break;
+		}
+
+		memmove (buffer, &buffer[len - overlap], overlap);
+		carry = overlap;
+		filePos += len - overlap;
 	}
 
-	return -1;
+	free (buffer);
+	return result;
+}
+
+char *duplicateString (const char *str) {
+	char *copy = (char*) malloc (strlen (str) + 1);
+	if (!copy) {
+		printf ("Out of memory\n");
+		exit (EXIT_FAILURE);
+	}
+	return strcpy (copy, str);
 }
 
 FILE *openDLDIFile(const char *argv0, char *dldiFileName ) {
@@ -157,6 +212,7 @@ FILE *openDLDIFile(const char *argv0, char *dldiFileName ) {
 	char appName[MAXPATHLEN];
 	char appPathName[MAXPATHLEN];
 
+	char argv0Copy[MAXPATHLEN];
 	char *ptr, *lastSlash;
 	struct stat buf;
 
@@ -195,8 +251,12 @@ FILE *openDLDIFile(const char *argv0, char *dldiFileName ) {
 	}
 	
 	
+	// Work on a copy so that this function can be called more than once
+	snprintf(argv0Copy, sizeof(argv0Copy), "%s", argv0);
+	argv0 = argv0Copy;
+
 	lastSlash = NULL;
-	ptr = (char *)argv0;
+	ptr = argv0Copy;
 		
 	while ( *(ptr++) != 0 ) {
 		if ( *ptr == '\\' || * ptr == '/' )
@@ -222,8 +282,12 @@ FILE *openDLDIFile(const char *argv0, char *dldiFileName ) {
 		// no path in argv0 so search system path
 		char *sysPATH = getenv("PATH");
 		char *nextPATH;
-		char *thisPATH = sysPATH;
+		char *thisPATH;
 		printf("Searching system path\n%s\n",sysPATH);
+
+		// The components of the path are split in a copy of it
+		sysPATH = duplicateString (sysPATH ? sysPATH : "");
+		thisPATH = sysPATH;
 		
 		while(1) {
 			nextPATH = strstr(thisPATH, ":" ); // find next PATH separator
@@ -243,6 +307,8 @@ FILE *openDLDIFile(const char *argv0, char *dldiFileName ) {
 			strcpy(appPath,"");		// empty path
 			if ( thisPATH == NULL) break;
 		}
+
+		free(sysPATH);
 	}
 
 	strcat(appPath,"dldi/");		// add dldi folder
@@ -252,224 +318,824 @@ FILE *openDLDIFile(const char *argv0, char *dldiFileName ) {
 	return fopen(appPath,"rb");		// no more places to check, just return this handle
 }
 
-int main(int argc, char* argv[])
-{
-	if ((argc == 2) && (strcmp(argv[1], "-V") == 0))
-	{
-		printf("dlditool " DLDITOOL_VERSION "\n");
-		return 0;
+// DLDI driver loaded in memory. It isn't modified while patching, so it can be
+// shared by many patches at the same time.
+typedef struct {
+	const char *name;		// Name as given by the user
+	char *fileName;			// Name with the .dldi extension
+	data_t *data;
+	size_t size;
+} DldiDriver;
+
+// Loads and validates a DLDI driver. The name is extended with the .dldi
+// extension and looked for in the search paths if needed.
+int loadDldiDriver (const char *argv0, const char *name, DldiDriver *driver) {
+	FILE *dldiFile;
+	data_t *pDH;
+
+	driver->name = name;
+	driver->fileName = (char*) malloc (strlen (name) + 1 + sizeof(dldiFileExtension));
+	if (!driver->fileName) {
+		printf ("Out of memory\n");
+		return EXIT_FAILURE;
 	}
+	strcpy (driver->fileName, name);
 
-	char *dldiFileName = NULL;
-	char *appFileName = NULL;
+	if (!(dldiFile = openDLDIFile(argv0,driver->fileName))) {
+		printf ("Cannot open \"%s\" - %s\n", driver->fileName, strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	fseek (dldiFile, 0, SEEK_END);
+	driver->size = ftell(dldiFile);
+	driver->data = (data_t*) malloc (driver->size);
+	fseek (dldiFile, 0, SEEK_SET);
+
+	if (!driver->data) {
+		fclose (dldiFile);
+		printf ("Out of memory\n");
+		return EXIT_FAILURE;
+	}
+
+	if (fread (driver->data, 1, driver->size, dldiFile) != driver->size) {
+		fclose (dldiFile);
+		printf ("Couldn't read DLDI driver: %s\n", driver->fileName);
+		return EXIT_FAILURE;
+	}
+
+	fclose (dldiFile);
+
+	pDH = driver->data;
+
+	// Make sure the DLDI file is valid and usable
+	if ((driver->size < DO_code) || (strcmp ((char*)dldiMagicString, (char*)&pDH[DO_magicString]) != 0)) {
+		printf ("Invalid DLDI file\n");
+		return EXIT_FAILURE;
+	}
+	if (pDH[DO_version] != DLDI_VERSION) {
+		printf ("Incorrect DLDI file version. Expected %d, found %d.\n", DLDI_VERSION, pDH[DO_version]);
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
+
+// Finds the DLDI section of an application. Returns -1 if there is no DLDI
+// section and -2 on error.
+addr_t findAppDldiSection (const char *appFileName) {
+	FILE *appFile;
+	addr_t patchOffset;
+
+	if (!(appFile = fopen (appFileName, "rb"))) {
+		printf ("Cannot open \"%s\" - %s\n", appFileName, strerror(errno));
+		return -2;
+	}
+
+	patchOffset = findDldiSection (appFile, dldiMagicString, sizeof(dldiMagicString)/sizeof(char));
+	fclose (appFile);
+
+	if (patchOffset == -2) {
+		printf ("Couldn't read application: %s\n", appFileName);
+	} else if (patchOffset < 0) {
+		printf ("%s does not have a DLDI section\n", appFileName);
+	}
+
+	return patchOffset;
+}
+
+// Growable text buffer
+typedef struct {
+	char *text;
+	size_t len;
+	size_t size;
+} TextBuffer;
+
+void textPrintf (TextBuffer *buffer, const char *format, ...) {
+	va_list args;
+	int len;
+
+	va_start (args, format);
+	len = vsnprintf (NULL, 0, format, args);
+	va_end (args);
+
+	if (buffer->len + len + 1 > buffer->size) {
+		buffer->size = (buffer->len + len + 1) * 2;
+		buffer->text = (char*) realloc (buffer->text, buffer->size);
+		if (!buffer->text) {
+			printf ("Out of memory\n");
+			exit (EXIT_FAILURE);
+		}
+	}
+
+	va_start (args, format);
+	vsnprintf (&buffer->text[buffer->len], len + 1, format, args);
+	va_end (args);
+	buffer->len += len;
+}
+
+uint32_t crc32 (const data_t *data, size_t size) {
+	uint32_t crc = 0xFFFFFFFF;
+	size_t i;
+	int bit;
+
+	for (i = 0; i < size; i++) {
+		crc ^= data[i];
+		for (bit = 0; bit < 8; bit++) {
+			crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+		}
+	}
+
+	return ~crc;
+}
+
+// Relocates the words of a range of the patch that point inside the driver.
+// Pointers are always word-aligned, so only aligned words are checked. The
+// words that are relocated are marked in "fixed".
+void relocateRange (data_t *pAH, addr_t start, addr_t end, addr_t limit,
+		addr_t ddmemStart, addr_t ddmemEnd, addr_t relocationOffset, data_t *fixed) {
+	addr_t addrIter;
+	addr_t value;
+
+	if (start < 0) {
+		start = 0;
+	}
+
+	for (addrIter = (start + 3) & ~3; (addrIter < end) && (addrIter + 4 <= limit); addrIter += 4) {
+		value = readAddr (pAH, addrIter);
+		if ((ddmemStart <= value) && (value < ddmemEnd)) {
+			writeAddr (pAH, addrIter, value + relocationOffset);
+			fixed[addrIter / 4] = 1;
+		}
+	}
+}
+
+// Pointers of the header of the driver, which are always relocated
+const addr_t dldiHeaderPointers[] = {
+	// Section pointers
+	DO_text_start, DO_data_end, DO_glue_start, DO_glue_end,
+	DO_got_start, DO_got_end, DO_bss_start, DO_bss_end,
+	// Function pointers
+	DO_startup, DO_isInserted, DO_readSectors, DO_writeSectors,
+	DO_clearStatus, DO_shutdown
+};
 
+// Patches the DLDI section found at "patchOffset" in an application. Only the
+// area of the application that is patched is read and written. If "fixups"
+// isn't NULL, the list of relocated words is added to it (see verifyFixups()).
+int patchApp (const DldiDriver *driver, const char *appFileName, addr_t patchOffset, bool verbose, TextBuffer *fixups) {
 	addr_t memOffset;			// Offset of DLDI after the file is loaded into memory
-	addr_t patchOffset;			// Position of patch destination in the file
 	addr_t relocationOffset;	// Value added to all offsets within the patch to fix it properly
 	addr_t ddmemOffset;			// Original offset used in the DLDI file
 	addr_t ddmemStart;			// Start of range that offsets can be in the DLDI file
 	addr_t ddmemEnd;			// End of range that offsets can be in the DLDI file
 	addr_t ddmemSize;			// Size of range that offsets can be in the DLDI file
 
+	addr_t bssStart, bssEnd;
 	addr_t addrIter;
+	size_t i;
 
-	FILE* dldiFile;
 	FILE* appFile;
 
-	data_t *pDH;
+	const data_t *pDH = driver->data;
 	data_t *pAH;
 
-	data_t *appFileData = NULL;
-	size_t appFileSize = 0;
-	data_t *dldiFileData = NULL;
-	size_t dldiFileSize = 0;
-	
-	int i;
+	data_t *appPatchData = NULL;
+	data_t *fixed = NULL;		// One entry per word, set if it's relocated
+	size_t patchSize = 0;
+	data_t allocatedSpace;
 
-	printf ("Dynamically Linked Disk Interface patch tool " DLDITOOL_VERSION " by Michael Chisholm (Chishm)\n\n");
+	if (!(appFile = fopen (appFileName, "rb+"))) {
+		printf ("Cannot open \"%s\" - %s\n", appFileName, strerror(errno));
+		return EXIT_FAILURE;
+	}
 
-	for (i = 1; i < argc; i++) {
-		if (dldiFileName == NULL) {
-			dldiFileName = (char*) malloc (strlen (argv[i]) + 1 + sizeof(dldiFileExtension));
-			if (!dldiFileName) {
-				return EXIT_FAILURE;
-			}
-			strcpy (dldiFileName, argv[i]);
-		} else if (appFileName == NULL) {
-			appFileName = (char*) malloc (strlen (argv[i]) + 1);
-			if (!appFileName) {
-				return EXIT_FAILURE;
+	ddmemStart = readAddr (pDH, DO_text_start);
+	ddmemSize = (1 << pDH[DO_driverSize]);
+	ddmemEnd = ddmemStart + ddmemSize;
+
+	// Load the area of the application that is going to be patched. The DLDI
+	// file may be bigger than the area, and the area may go past the end of
+	// the file.
+	patchSize = ((size_t)ddmemSize > driver->size) ? (size_t)ddmemSize : driver->size;
+	appPatchData = (data_t*) calloc (1, patchSize);
+	fixed = (data_t*) calloc (1, patchSize / 4 + 1);
+	if (!appPatchData || !fixed) {
+		fclose (appFile);
+		free (appPatchData);
+		free (fixed);
+		printf ("Out of memory\n");
+		return EXIT_FAILURE;
+	}
+
+	fseek (appFile, patchOffset, SEEK_SET);
+	if ((fread (appPatchData, 1, patchSize, appFile) < DO_code) ||
+		(memcmp (appPatchData, dldiMagicString, sizeof(dldiMagicString)) != 0)) {
+		fclose (appFile);
+		free (appPatchData);
+		free (fixed);
+		printf ("Couldn't read the DLDI section of application: %s\n", appFileName);
+		return EXIT_FAILURE;
+	}
+
+	pAH = appPatchData;
+
+	if (pDH[DO_driverSize] > pAH[DO_allocatedSpace]) {
+		printf ("Warning: Not enough space for patch. Available %d bytes, need %d bytes\n", ( 1 << pAH[DO_allocatedSpace]), ( 1 << pDH[DO_driverSize]) );
+		//return EXIT_FAILURE;
+	}
+
+	memOffset = readAddr (pAH, DO_text_start);
+	if (memOffset == 0) {
+			memOffset = readAddr (pAH, DO_startup) - DO_code;
+	}
+	ddmemOffset = readAddr (pDH, DO_text_start);
+	relocationOffset = memOffset - ddmemOffset;
+
+	if (verbose) {
+		printf ("Old driver:          %s\n", &pAH[DO_friendlyName]);
+		printf ("New driver:          %s\n", &pDH[DO_friendlyName]);
+		printf ("\n");
+		printf ("Position in file:    0x%08X\n", patchOffset);
+		printf ("Position in memory:  0x%08X\n", memOffset);
+		printf ("Patch base address:  0x%08X\n", ddmemOffset);
+		printf ("Relocation offset:   0x%08X\n", relocationOffset);
+		printf ("\n");
+	}
+
+	// Remember how much space is actually reserved
+	allocatedSpace = pAH[DO_allocatedSpace];
+	// Copy the DLDI patch into the application
+	memcpy (pAH, pDH, driver->size);
+	pAH[DO_allocatedSpace] = allocatedSpace;
+
+	// Fix the section and function pointers in the header
+	for (i = 0; i < sizeof(dldiHeaderPointers) / sizeof(dldiHeaderPointers[0]); i++) {
+		writeAddr (pAH, dldiHeaderPointers[i], readAddr (pAH, dldiHeaderPointers[i]) + relocationOffset);
+		fixed[dldiHeaderPointers[i] / 4] = 1;
+	}
+
+	if (pDH[DO_fixSections] & FIX_ALL) { 
+		// Search through and fix pointers within the data section of the file
+		relocateRange (pAH, readAddr(pDH, DO_text_start) - ddmemStart, readAddr(pDH, DO_data_end) - ddmemStart,
+				patchSize, ddmemStart, ddmemEnd, relocationOffset, fixed);
+	}
+
+	if (pDH[DO_fixSections] & FIX_GLUE) { 
+		// Search through and fix pointers within the glue section of the file
+		relocateRange (pAH, readAddr(pDH, DO_glue_start) - ddmemStart, readAddr(pDH, DO_glue_end) - ddmemStart,
+				patchSize, ddmemStart, ddmemEnd, relocationOffset, fixed);
+	}
+
+	if (pDH[DO_fixSections] & FIX_GOT) { 
+		// Search through and fix pointers within the Global Offset Table section of the file
+		relocateRange (pAH, readAddr(pDH, DO_got_start) - ddmemStart, readAddr(pDH, DO_got_end) - ddmemStart,
+				patchSize, ddmemStart, ddmemEnd, relocationOffset, fixed);
+	}
+
+	bssStart = readAddr(pDH, DO_bss_start) - ddmemStart;
+	bssEnd = readAddr(pDH, DO_bss_end) - ddmemStart;
+
+	if (pDH[DO_fixSections] & FIX_BSS) { 
+		// Initialise the BSS to 0
+		memset (&pAH[bssStart] , 0, bssEnd - bssStart);
+	}
+
+	if (fixups) {
+		// Words that have been cleared as part of the BSS aren't listed
+		textPrintf (fixups, "file %s\n", appFileName);
+		textPrintf (fixups, "section 0x%08X 0x%08X 0x%08X\n", patchOffset, ddmemSize, crc32 (pAH, ddmemSize));
+		for (addrIter = 0; addrIter + 4 <= ddmemSize; addrIter += 4) {
+			if (fixed[addrIter / 4] && !((pDH[DO_fixSections] & FIX_BSS) && (addrIter + 4 > bssStart) && (addrIter < bssEnd))) {
+				textPrintf (fixups, "fixup 0x%08X 0x%08X\n", patchOffset + addrIter, readAddr (pAH, addrIter));
 			}
-			strcpy (appFileName, argv[i]);
-		} else {
-			printUsage (argv[0]);
-			return EXIT_FAILURE;
 		}
 	}
 
-	if ((dldiFileName == NULL) || (appFileName == NULL)) {
-		printUsage (argv[0]);
+	// Write the patch back to the file. The rest of the file isn't modified.
+	fseek (appFile, patchOffset, SEEK_SET);
+	if ((fwrite (pAH, 1, ddmemSize, appFile) != (size_t)ddmemSize) || (fclose (appFile) != 0)) {
+		printf ("Couldn't write application: %s\n", appFileName);
 		return EXIT_FAILURE;
 	}
 
-	if (!(dldiFile = openDLDIFile(argv[0],dldiFileName))) {
-		printf ("Cannot open \"%s\" - %s\n", dldiFileName, strerror(errno));
-			return EXIT_FAILURE;
+	free (appPatchData);
+	free (fixed);
+
+	return EXIT_SUCCESS;
+}
+
+// Checks patched applications against a list of fixups generated when they
+// were patched. The list has one block per application:
+//
+//     file <path of the application>
+//     section <file offset> <size> <CRC-32 of the patched DLDI section>
+//     fixup <file offset> <value>
+//     fixup ...
+//
+// All numbers are in hexadecimal. Every fixup is a word of the driver that has
+// been relocated, and its value after the relocation.
+int verifyFixups (const char *listFileName) {
+	char line[MAXPATHLEN + 16];
+	char appFileName[sizeof(line)] = "";
+	unsigned int offset, size, crc, value;
+	data_t *section = NULL;
+	unsigned int sectionOffset = 0, sectionSize = 0;
+	bool failed = false;		// The current application has failed
+	int files = 0, errors = 0;
+	int lineNumber = 0;
+	FILE *listFile, *appFile;
+
+	if (!(listFile = fopen (listFileName, "r"))) {
+		printf ("Cannot open \"%s\" - %s\n", listFileName, strerror(errno));
+		return EXIT_FAILURE;
 	}
 
-	if (!(appFile = fopen (appFileName, "rb+"))) {
-		printf ("Cannot open \"%s\" - %s\n", appFileName, strerror(errno));
+	while (fgets (line, sizeof(line), listFile)) {
+		lineNumber++;
+		line[strcspn (line, "\r\n")] = '\0';
+
+		if (strncmp (line, "file ", 5) == 0) {
+			snprintf (appFileName, sizeof(appFileName), "%s", &line[5]);
+			free (section);
+			section = NULL;
+			failed = false;
+			files++;
+		} else if (sscanf (line, "section %x %x %x", &offset, &size, &crc) == 3) {
+			size_t readSize = 0;
+
+			if ((appFileName[0] == '\0') || section) {
+				break;
+			}
+
+			section = (data_t*) malloc (size ? size : 1);
+			if (!section) {
+				printf ("Out of memory\n");
+				fclose (listFile);
+				return EXIT_FAILURE;
+			}
+			sectionOffset = offset;
+			sectionSize = size;
+
+			if ((appFile = fopen (appFileName, "rb"))) {
+				fseek (appFile, offset, SEEK_SET);
+				readSize = fread (section, 1, size, appFile);
+				fclose (appFile);
+			}
+
+			if ((readSize != size) || (crc32 (section, size) != crc)) {
+				printf ("%s: The DLDI section at 0x%08X doesn't match\n", appFileName, offset);
+				failed = true;
+				errors++;
+			}
+		} else if (sscanf (line, "fixup %x %x", &offset, &value) == 2) {
+			if (!section || (offset < sectionOffset) || (offset - sectionOffset + 4 > sectionSize)) {
+				break;
+			}
+
+			if (!failed && ((uint32_t)readAddr (section, offset - sectionOffset) != value)) {
+				printf ("%s: Word at 0x%08X is 0x%08X, expected 0x%08X\n", appFileName,
+						offset, (uint32_t)readAddr (section, offset - sectionOffset), value);
+				failed = true;
+				errors++;
+			}
+		} else if ((line[0] != '\0') && (line[0] != '#')) {
+			break;
+		}
+	}
+
+	free (section);
+
+	if (!feof (listFile)) {
+		printf ("%s:%d: Invalid fixup list\n", listFileName, lineNumber);
+		fclose (listFile);
 		return EXIT_FAILURE;
 	}
 
-	// Load the app file and the DLDI patch file
-	fseek (appFile, 0, SEEK_END);
-	appFileSize = ftell(appFile);
-	appFileData = (data_t*) malloc (appFileSize);
-	fseek (appFile, 0, SEEK_SET);
+	fclose (listFile);
 
-	fseek (dldiFile, 0, SEEK_END);
-	dldiFileSize = ftell(dldiFile);
-	dldiFileData = (data_t*) malloc (dldiFileSize);
-	fseek (dldiFile, 0, SEEK_SET);
+	printf ("%d of %d applications verified\n", files - errors, files);
+	return (errors == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
 
-	if (!appFileData || !dldiFileData) {
-		fclose (appFile);
-		fclose (dldiFile);
-		if (appFileData) free (appFileData);
-		if (dldiFileData) free (dldiFileData);
-		printf ("Out of memory\n");
+int saveFixups (const char *fixupFileName, const TextBuffer *fixups) {
+	FILE *fixupFile;
+
+	if (!(fixupFile = fopen (fixupFileName, "w"))) {
+		printf ("Cannot open \"%s\" - %s\n", fixupFileName, strerror(errno));
 		return EXIT_FAILURE;
 	}
 
-	if (fread (appFileData, 1, appFileSize, appFile) != appFileSize) {
-		fclose (appFile);
-		fclose (dldiFile);
-		free (appFileData);
-		free (dldiFileData);
-		printf ("Couldn't read application: %s\n", appFileName);
+	fputs ("# dlditool fixup list\n", fixupFile);
+	if ((fixups->len > 0) && (fwrite (fixups->text, 1, fixups->len, fixupFile) != fixups->len)) {
+		fclose (fixupFile);
+		printf ("Couldn't write fixup list: %s\n", fixupFileName);
+		return EXIT_FAILURE;
+	}
+	if (fclose (fixupFile) != 0) {
+		printf ("Couldn't write fixup list: %s\n", fixupFileName);
 		return EXIT_FAILURE;
 	}
 
-	if (fread (dldiFileData, 1, dldiFileSize, dldiFile) != dldiFileSize) {
-		fclose (appFile);
-		fclose (dldiFile);
-		free (appFileData);
-		free (dldiFileData);
-		printf ("Couldn't read DLDI driver: %s\n", dldiFileName);
+	return EXIT_SUCCESS;
+}
+
+// Batch mode
+// ----------
+
+// Application that is patched in batch mode. If "outFileName" isn't NULL, the
+// application is copied there and the copy is patched.
+typedef struct {
+	int driver;
+	int source;
+	char *appFileName;
+	char *outFileName;
+	int result;
+	TextBuffer fixups;
+} BatchJob;
+
+// Application that is used as the source of one or more batch jobs. The
+// position of the DLDI section is only looked for once.
+typedef struct {
+	char *fileName;
+	addr_t patchOffset;
+} BatchSource;
+
+DldiDriver *batchDrivers;
+int batchDriverCount;
+BatchSource *batchSources;
+int batchSourceCount;
+BatchJob *batchJobs;
+int batchJobCount;
+
+bool batchFixups;
+int batchNextItem;
+pthread_mutex_t batchLock = PTHREAD_MUTEX_INITIALIZER;
+
+void *growArray (void *array, int count, size_t itemSize) {
+	// Arrays grow when the count reaches a power of two
+	if ((count & (count - 1)) == 0) {
+		array = realloc (array, (count ? count * 2 : 16) * itemSize);
+		if (!array) {
+			printf ("Out of memory\n");
+			exit (EXIT_FAILURE);
+		}
+	}
+	return array;
+}
+
+// Returns the index of a driver, loading it if it hasn't been loaded yet
+int batchGetDriver (const char *argv0, const char *name) {
+	int i;
+	for (i = 0; i < batchDriverCount; i++) {
+		if (strcmp (batchDrivers[i].name, name) == 0) {
+			return i;
+		}
+	}
+
+	batchDrivers = (DldiDriver*) growArray (batchDrivers, batchDriverCount, sizeof(DldiDriver));
+	if (loadDldiDriver (argv0, duplicateString (name), &batchDrivers[batchDriverCount]) != EXIT_SUCCESS) {
+		exit (EXIT_FAILURE);
+	}
+	return batchDriverCount++;
+}
+
+const char *batchJobTarget (const BatchJob *job) {
+	return job->outFileName ? job->outFileName : job->appFileName;
+}
+
+int batchGetSource (const char *fileName) {
+	int i;
+	for (i = 0; i < batchSourceCount; i++) {
+		if (strcmp (batchSources[i].fileName, fileName) == 0) {
+			return i;
+		}
+	}
+
+	batchSources = (BatchSource*) growArray (batchSources, batchSourceCount, sizeof(BatchSource));
+	batchSources[batchSourceCount].fileName = duplicateString (fileName);
+	batchSources[batchSourceCount].patchOffset = -1;
+	return batchSourceCount++;
+}
+
+// Reads a list of patches. Every line has the name of a DLDI driver, the
+// application to patch and, optionally, the file where the patched copy of the
+// application is saved. The fields are separated by tabs. Empty lines and lines
+// that start with '#' are ignored.
+int batchReadList (const char *argv0, const char *listFileName) {
+	char line[3 * MAXPATHLEN];
+	char *fields[3];
+	int lineNumber = 0;
+	int count, i, j;
+	FILE *listFile;
+
+	if (!(listFile = fopen (listFileName, "r"))) {
+		printf ("Cannot open \"%s\" - %s\n", listFileName, strerror(errno));
 		return EXIT_FAILURE;
 	}
 
-	fclose (dldiFile);
+	while (fgets (line, sizeof(line), listFile)) {
+		char *ptr = line;
 
-	// Find the DSDI reserved space in the file
-	patchOffset = quickFind (appFileData, dldiMagicString, appFileSize, sizeof(dldiMagicString)/sizeof(char));
+		lineNumber++;
+		line[strcspn (line, "\r\n")] = '\0';
+		if ((line[0] == '\0') || (line[0] == '#')) {
+			continue;
+		}
 
-	if (patchOffset < 0) {
-		printf ("%s does not have a DLDI section\n", appFileName);
-		return EXIT_NO_DLDI_SECTION;
+		for (count = 0; (count < 3) && ptr; count++) {
+			fields[count] = ptr;
+			ptr = strchr (ptr, '\t');
+			if (ptr) {
+				*(ptr++) = '\0';
+			}
+		}
+
+		if (ptr || (count < 2) || (fields[0][0] == '\0') || (fields[1][0] == '\0')) {
+			printf ("%s:%d: Expected <dldi><TAB><app>[<TAB><output>]\n", listFileName, lineNumber);
+			fclose (listFile);
+			return EXIT_FAILURE;
+		}
+
+		batchJobs = (BatchJob*) growArray (batchJobs, batchJobCount, sizeof(BatchJob));
+		BatchJob *job = &batchJobs[batchJobCount++];
+		job->driver = batchGetDriver (argv0, fields[0]);
+		job->source = batchGetSource (fields[1]);
+		job->appFileName = batchSources[job->source].fileName;
+		job->outFileName = ((count == 3) && (fields[2][0] != '\0')) ? duplicateString (fields[2]) : NULL;
+		job->result = EXIT_SUCCESS;
+		memset (&job->fixups, 0, sizeof(job->fixups));
 	}
 
-	pDH = dldiFileData;
-	pAH = &appFileData[patchOffset];
+	fclose (listFile);
 
-	// Make sure the DLDI file is valid and usable
-	if (strcmp ((char*)dldiMagicString, (char*)&pDH[DO_magicString]) != 0) {
-		printf ("Invalid DLDI file\n");
+	// Jobs run at the same time, so every file can only be written by one job,
+	// and a file that is written can't be the source of a copy.
+	for (i = 0; i < batchJobCount; i++) {
+		const char *target = batchJobTarget (&batchJobs[i]);
+		for (j = 0; j < batchJobCount; j++) {
+			if ((j > i) && (strcmp (target, batchJobTarget (&batchJobs[j])) == 0)) {
+				printf ("%s is written by more than one patch\n", target);
+				return EXIT_FAILURE;
+			}
+			if (batchJobs[j].outFileName && (strcmp (target, batchJobs[j].appFileName) == 0)) {
+				printf ("%s is patched and copied at the same time\n", target);
+				return EXIT_FAILURE;
+			}
+		}
+	}
+
+	return EXIT_SUCCESS;
+}
+
+int copyFile (const char *srcFileName, const char *dstFileName) {
+	FILE *srcFile, *dstFile;
+	data_t *buffer;
+	size_t len;
+	int result = EXIT_SUCCESS;
+
+	if (!(srcFile = fopen (srcFileName, "rb"))) {
+		printf ("Cannot open \"%s\" - %s\n", srcFileName, strerror(errno));
 		return EXIT_FAILURE;
 	}
-	if (pDH[DO_version] != DLDI_VERSION) {
-		printf ("Incorrect DLDI file version. Expected %d, found %d.\n", DLDI_VERSION, pDH[DO_version]);
+	if (!(dstFile = fopen (dstFileName, "wb"))) {
+		printf ("Cannot open \"%s\" - %s\n", dstFileName, strerror(errno));
+		fclose (srcFile);
 		return EXIT_FAILURE;
 	}
-	if (pDH[DO_driverSize] > pAH[DO_allocatedSpace]) {
-		printf ("Warning: Not enough space for patch. Available %d bytes, need %d bytes\n", ( 1 << pAH[DO_allocatedSpace]), ( 1 << pDH[DO_driverSize]) );
-		//return EXIT_FAILURE;
+
+	buffer = (data_t*) malloc (SCAN_CHUNK_SIZE);
+	if (!buffer) {
+		printf ("Out of memory\n");
+		result = EXIT_FAILURE;
 	}
 
-	memOffset = readAddr (pAH, DO_text_start);
-	if (memOffset == 0) {
-			memOffset = readAddr (pAH, DO_startup) - DO_code;
+	while ((result == EXIT_SUCCESS) && ((len = fread (buffer, 1, SCAN_CHUNK_SIZE, srcFile)) > 0)) {
+		if (fwrite (buffer, 1, len, dstFile) != len) {
+			result = EXIT_FAILURE;
+		}
 	}
-	ddmemOffset = readAddr (pDH, DO_text_start);
-	relocationOffset = memOffset - ddmemOffset;
+	if (ferror (srcFile) || (fclose (dstFile) != 0)) {
+		result = EXIT_FAILURE;
+	}
+	fclose (srcFile);
+	free (buffer);
 
-	printf ("Old driver:          %s\n", &pAH[DO_friendlyName]);
-	printf ("New driver:          %s\n", &pDH[DO_friendlyName]);
-	printf ("\n");
-	printf ("Position in file:    0x%08X\n", patchOffset);
-	printf ("Position in memory:  0x%08X\n", memOffset);
-	printf ("Patch base address:  0x%08X\n", ddmemOffset);
-	printf ("Relocation offset:   0x%08X\n", relocationOffset);
-	printf ("\n");
+	if (result != EXIT_SUCCESS) {
+		printf ("Couldn't copy %s to %s\n", srcFileName, dstFileName);
+	}
+	return result;
+}
 
-	ddmemStart = readAddr (pDH, DO_text_start);
-	ddmemSize = (1 << pDH[DO_driverSize]);
-	ddmemEnd = ddmemStart + ddmemSize;
+// Takes items from a shared counter until there are none left. The first pass
+// looks for the DLDI sections of the sources and the second one patches them.
+int batchTakeItem (int count) {
+	int item;
+	pthread_mutex_lock (&batchLock);
+	item = batchNextItem++;
+	pthread_mutex_unlock (&batchLock);
+	return (item < count) ? item : -1;
+}
 
-	// Remember how much space is actually reserved
-	pDH[DO_allocatedSpace] = pAH[DO_allocatedSpace];
-	// Copy the DLDI patch into the application
-	memcpy (pAH, pDH, dldiFileSize);
-
-	// Fix the section pointers in the header
-	writeAddr (pAH, DO_text_start, readAddr (pAH, DO_text_start) + relocationOffset);
-	writeAddr (pAH, DO_data_end, readAddr (pAH, DO_data_end) + relocationOffset);
-	writeAddr (pAH, DO_glue_start, readAddr (pAH, DO_glue_start) + relocationOffset);
-	writeAddr (pAH, DO_glue_end, readAddr (pAH, DO_glue_end) + relocationOffset);
-	writeAddr (pAH, DO_got_start, readAddr (pAH, DO_got_start) + relocationOffset);
-	writeAddr (pAH, DO_got_end, readAddr (pAH, DO_got_end) + relocationOffset);
-	writeAddr (pAH, DO_bss_start, readAddr (pAH, DO_bss_start) + relocationOffset);
-	writeAddr (pAH, DO_bss_end, readAddr (pAH, DO_bss_end) + relocationOffset);
-	// Fix the function pointers in the header
-	writeAddr (pAH, DO_startup, readAddr (pAH, DO_startup) + relocationOffset);
-	writeAddr (pAH, DO_isInserted, readAddr (pAH, DO_isInserted) + relocationOffset);
-	writeAddr (pAH, DO_readSectors, readAddr (pAH, DO_readSectors) + relocationOffset);
-	writeAddr (pAH, DO_writeSectors, readAddr (pAH, DO_writeSectors) + relocationOffset);
-	writeAddr (pAH, DO_clearStatus, readAddr (pAH, DO_clearStatus) + relocationOffset);
-	writeAddr (pAH, DO_shutdown, readAddr (pAH, DO_shutdown) + relocationOffset);
+void *batchFindWorker (void *arg) {
+	int i;
+	(void)arg;
+	while ((i = batchTakeItem (batchSourceCount)) >= 0) {
+		batchSources[i].patchOffset = findAppDldiSection (batchSources[i].fileName);
+	}
+	return NULL;
+}
 
-	if (pDH[DO_fixSections] & FIX_ALL) { 
-		// Search through and fix pointers within the data section of the file
-		for (addrIter = (readAddr(pDH, DO_text_start) - ddmemStart); addrIter < (readAddr(pDH, DO_data_end) - ddmemStart); addrIter++) {
-			if ((ddmemStart <= readAddr(pAH, addrIter)) && (readAddr(pAH, addrIter) < ddmemEnd)) {
-				writeAddr (pAH, addrIter, readAddr(pAH, addrIter) + relocationOffset);
-			}
+void *batchPatchWorker (void *arg) {
+	int i;
+	(void)arg;
+	while ((i = batchTakeItem (batchJobCount)) >= 0) {
+		BatchJob *job = &batchJobs[i];
+		addr_t patchOffset = batchSources[job->source].patchOffset;
+		const char *target = batchJobTarget (job);
+
+		if (patchOffset == -1) {
+			job->result = EXIT_NO_DLDI_SECTION;
+			continue;
+		}
+		if (patchOffset < 0) {
+			job->result = EXIT_FAILURE;
+			continue;
+		}
+		if (job->outFileName && (copyFile (job->appFileName, job->outFileName) != EXIT_SUCCESS)) {
+			job->result = EXIT_FAILURE;
+			continue;
+		}
+
+		job->result = patchApp (&batchDrivers[job->driver], target, patchOffset, false,
+				batchFixups ? &job->fixups : NULL);
+		if (job->result == EXIT_SUCCESS) {
+			printf ("Patched %s with %s\n", target, batchDrivers[job->driver].fileName);
 		}
 	}
+	return NULL;
+}
 
-	if (pDH[DO_fixSections] & FIX_GLUE) { 
-		// Search through and fix pointers within the glue section of the file
-		for (addrIter = (readAddr(pDH, DO_glue_start) - ddmemStart); addrIter < (readAddr(pDH, DO_glue_end) - ddmemStart); addrIter++) {
-			if ((ddmemStart <= readAddr(pAH, addrIter)) && (readAddr(pAH, addrIter) < ddmemEnd)) {
-				writeAddr (pAH, addrIter, readAddr(pAH, addrIter) + relocationOffset);
+void batchRun (void *(*worker)(void *), long threads) {
+	pthread_t *tids = (pthread_t*) malloc (threads * sizeof(pthread_t));
+	long started = 0, i;
+
+	batchNextItem = 0;
+
+	// The main thread works as one of the workers
+	if (tids) {
+		for (; started < threads - 1; started++) {
+			if (pthread_create (&tids[started], NULL, worker, NULL) != 0) {
+				break;
 			}
 		}
 	}
 
-	if (pDH[DO_fixSections] & FIX_GOT) { 
-		// Search through and fix pointers within the Global Offset Table section of the file
-		for (addrIter = (readAddr(pDH, DO_got_start) - ddmemStart); addrIter < (readAddr(pDH, DO_got_end) - ddmemStart); addrIter++) {
-			if ((ddmemStart <= readAddr(pAH, addrIter)) && (readAddr(pAH, addrIter) < ddmemEnd)) {
-				writeAddr (pAH, addrIter, readAddr(pAH, addrIter) + relocationOffset);
+	worker (NULL);
+
+	for (i = 0; i < started; i++) {
+		pthread_join (tids[i], NULL);
+	}
+	free (tids);
+}
+
+int batchPatch (const char *argv0, const char *listFileName, const char *fixupFileName, long threads) {
+	int result = EXIT_SUCCESS;
+	int patched = 0;
+	int i;
+
+	if (batchReadList (argv0, listFileName) != EXIT_SUCCESS) {
+		return EXIT_FAILURE;
+	}
+
+	if (threads < 1) {
+		threads = 1;
+	}
+
+	batchFixups = (fixupFileName != NULL);
+
+	batchRun (batchFindWorker, threads);
+	batchRun (batchPatchWorker, threads);
+
+	if (fixupFileName) {
+		TextBuffer fixups = { NULL, 0, 0 };
+
+		// The fixups of all applications are saved in the order of the list
+		for (i = 0; i < batchJobCount; i++) {
+			if (batchJobs[i].result == EXIT_SUCCESS) {
+				textPrintf (&fixups, "%s", batchJobs[i].fixups.text);
 			}
+			free (batchJobs[i].fixups.text);
+		}
+
+		if (saveFixups (fixupFileName, &fixups) != EXIT_SUCCESS) {
+			result = EXIT_FAILURE;
 		}
+		free (fixups.text);
 	}
 
-	if (pDH[DO_fixSections] & FIX_BSS) { 
-		// Initialise the BSS to 0
-		memset (&pAH[readAddr(pDH, DO_bss_start) - ddmemStart] , 0, readAddr(pDH, DO_bss_end) - readAddr(pDH, DO_bss_start));
+	// Report the first error, if any
+	for (i = 0; i < batchJobCount; i++) {
+		if (batchJobs[i].result == EXIT_SUCCESS) {
+			patched++;
+		} else if (result == EXIT_SUCCESS) {
+			result = batchJobs[i].result;
+		}
 	}
 
-	// Write the patch back to the file
-	fseek (appFile, patchOffset, SEEK_SET);
-	fwrite (pAH, 1, ddmemSize, appFile);
-	fclose (appFile);
+	printf ("%d of %d patches applied\n", patched, batchJobCount);
+	return result;
+}
+
+int main(int argc, char* argv[])
+{
+	if ((argc == 2) && (strcmp(argv[1], "-V") == 0))
+	{
+		printf("dlditool " DLDITOOL_VERSION "\n");
+		return 0;
+	}
+
+	char *dldiFileName = NULL;
+	char *appFileName = NULL;
+	char *listFileName = NULL;
+	char *fixupFileName = NULL;
+	char *verifyFileName = NULL;
+	TextBuffer fixups = { NULL, 0, 0 };
+	long threads = 1;
+	DldiDriver driver;
+	addr_t patchOffset;
+	int result;
+	int i;
 
-	free (appFileData);
-	free (dldiFileData);
+#ifndef _MSC_VER
+	threads = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
 
-	printf ("Patched successfully\n");
+	printf ("Dynamically Linked Disk Interface patch tool " DLDITOOL_VERSION " by Michael Chisholm (Chishm)\n\n");
 
-	return EXIT_SUCCESS;
+	for (i = 1; i < argc; i++) {
+		if ((strcmp (argv[i], "-b") == 0) && (i + 1 < argc)) {
+			listFileName = argv[++i];
+		} else if ((strcmp (argv[i], "-f") == 0) && (i + 1 < argc)) {
+			fixupFileName = argv[++i];
+		} else if ((strcmp (argv[i], "-c") == 0) && (i + 1 < argc)) {
+			verifyFileName = argv[++i];
+		} else if ((strcmp (argv[i], "-j") == 0) && (i + 1 < argc)) {
+			threads = atol (argv[++i]);
+		} else if (dldiFileName == NULL) {
+			dldiFileName = argv[i];
+		} else if (appFileName == NULL) {
+			appFileName = argv[i];
+		} else {
+			printUsage (argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (verifyFileName != NULL) {
+		if ((dldiFileName != NULL) || (listFileName != NULL) || (fixupFileName != NULL)) {
+			printUsage (argv[0]);
+			return EXIT_FAILURE;
+		}
+		return verifyFixups (verifyFileName);
+	}
+
+	if (listFileName != NULL) {
+		if (dldiFileName != NULL) {
+			printUsage (argv[0]);
+			return EXIT_FAILURE;
+		}
+		return batchPatch (argv[0], listFileName, fixupFileName, threads);
+	}
+
+	if ((dldiFileName == NULL) || (appFileName == NULL)) {
+		printUsage (argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	if (loadDldiDriver (argv[0], dldiFileName, &driver) != EXIT_SUCCESS) {
+		return EXIT_FAILURE;
+	}
+
+	// Find the DSDI reserved space in the file
+	patchOffset = findAppDldiSection (appFileName);
+	if (patchOffset == -1) {
+		return EXIT_NO_DLDI_SECTION;
+	}
+	if (patchOffset < 0) {
+		return EXIT_FAILURE;
+	}
+
+	result = patchApp (&driver, appFileName, patchOffset, true, fixupFileName ? &fixups : NULL);
+	if (result == EXIT_SUCCESS) {
+		printf ("Patched successfully\n");
+		if (fixupFileName) {
+			result = saveFixups (fixupFileName, &fixups);
+		}
+	}
+
+	free (fixups.text);
+	free (driver.fileName);
+	free (driver.data);
+
+	return result;
 }
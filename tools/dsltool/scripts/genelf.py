@@ -0,0 +1,212 @@
+#!/usr/bin/env python3
+
+# SPDX-License-Identifier: CC0-1.0
+#
+# SPDX-FileContributor: Antonio Niño Díaz, 2026
+
+# Synthetic ELF files to measure the speed of dsltool with big libraries. It
+# generates a library with the given number of symbols and relocations, and a
+# main binary that defines all the symbols that the library imports:
+#
+#     python3 scripts/genelf.py --symbols 100000 /tmp/bench
+#     time ./dsltool -i /tmp/bench/library.elf -m /tmp/bench/main.elf \
+#                    -o /tmp/bench/library.dsl
+#
+# Use --pointer-tables to add tables of pointers to the library (like vtables or
+# jump tables). They are relocated relative to the .progbits section symbol, so
+# they can be used to check how dsltool packs relocations (-r option).
+#
+# The files only have the sections and symbols that dsltool reads, they can't
+# be used with other tools.
+
+import argparse
+import os
+import random
+import struct
+import sys
+
+ET_EXEC = 2
+EM_ARM = 40
+
+SHT_PROGBITS = 1
+SHT_SYMTAB = 2
+SHT_STRTAB = 3
+SHT_NOBITS = 8
+SHT_REL = 9
+
+STB_LOCAL = 0
+STB_GLOBAL = 1
+
+STT_NOTYPE = 0
+STT_OBJECT = 1
+STT_FUNC = 2
+STT_SECTION = 3
+
+STV_DEFAULT = 0
+STV_HIDDEN = 2
+
+R_ARM_ABS32 = 2
+R_ARM_CALL = 28
+R_ARM_THM_CALL = 10
+
+
+class StringTable:
+    def __init__(self):
+        self.data = bytearray(b'\0')
+
+    def add(self, s):
+        offset = len(self.data)
+        self.data += s.encode() + b'\0'
+        return offset
+
+
+def symbol(name, value, size, bind, type_, other, shndx):
+    return struct.pack('<IIIBBH', name, value, size, (bind << 4) | type_,
+                       other, shndx)
+
+
+def write_elf(path, sections, shstrtab):
+    # sections: list of (name, type, addr, data or size, link, info, entsize)
+    ehdr_size = 52
+    phdr_size = 32
+
+    body = bytearray()
+    offset = ehdr_size + phdr_size
+    headers = [bytes(40)]
+
+    names = [shstrtab.add(s[0]) for s in sections]
+    shstrtab_name = shstrtab.add('.shstrtab')
+    sections = sections + [('.shstrtab', SHT_STRTAB, 0, bytes(shstrtab.data),
+                            0, 0, 0)]
+    names.append(shstrtab_name)
+
+    for (name, type_, addr, data, link, info, entsize), name_off in zip(sections, names):
+        if type_ == SHT_NOBITS:
+            size = data
+            data = b''
+        else:
+            size = len(data)
+        headers.append(struct.pack('<IIIIIIIIII', name_off, type_, 0, addr,
+                                   offset + len(body), size, link, info, 4,
+                                   entsize))
+        body += data
+        body += bytes(-len(body) % 4)
+
+    shoff = offset + len(body)
+    ident = b'\x7fELF' + bytes([1, 1, 1]) + bytes(9)
+    ehdr = ident + struct.pack('<HHIIIIIHHHHHH', ET_EXEC, EM_ARM, 1, 0,
+                               ehdr_size, shoff, 0, ehdr_size, phdr_size, 1,
+                               40, len(headers), len(headers) - 1)
+    phdr = struct.pack('<IIIIIIII', 1, offset, 0, 0, 0, 0, 7, 4)
+
+    with open(path, 'wb') as f:
+        f.write(ehdr + phdr + body + b''.join(headers))
+
+
+def gen_library(path, rng, num_symbols, imported, progbits_size, pointer_tables):
+    strtab = StringTable()
+    syms = [bytes(16)]
+    # Section symbol of .progbits, as generated by the linker
+    syms.append(symbol(0, 0, 0, STB_LOCAL, STT_SECTION, 0, 1))
+
+    for i in range(num_symbols):
+        kind = rng.random()
+        value = rng.randrange(0, progbits_size // 4) * 4
+        if kind < 0.2:
+            name = f'_ZN6plugin5stage{i}4tickEv'
+            syms.append(symbol(strtab.add(name), value, 4, STB_GLOBAL,
+                               STT_FUNC, STV_DEFAULT, 1))
+        elif kind < 0.6:
+            name = f'_ZN6plugin6detail{i}6helperEi'
+            syms.append(symbol(strtab.add(name), value, 4, STB_GLOBAL,
+                               STT_FUNC, STV_HIDDEN, 1))
+        elif kind < 0.8:
+            name = f'_ZL11local_table{i}'
+            syms.append(symbol(strtab.add(name), value, 4, STB_LOCAL,
+                               STT_OBJECT, STV_DEFAULT, 1))
+        else:
+            name = rng.choice(imported)
+            syms.append(symbol(strtab.add(name), 0, 0, STB_GLOBAL, STT_NOTYPE,
+                               STV_DEFAULT, 0))
+
+    # Relocations only use a third of the symbols so that the number of symbols
+    # left after removing unused ones fits in a DSL file.
+    rels = bytearray()
+    for i in range(num_symbols * 2):
+        offset = rng.randrange(0, progbits_size // 4) * 4
+        type_ = rng.choice([R_ARM_ABS32, R_ARM_CALL, R_ARM_THM_CALL])
+        sym = rng.randrange(1, max(2, len(syms) // 3))
+        rels += struct.pack('<II', offset, (sym << 8) | type_)
+
+    for i in range(pointer_tables):
+        offset = rng.randrange(0, progbits_size // 4) * 4
+        for j in range(rng.randrange(1, 33)):
+            if offset + j * 4 >= progbits_size:
+                break
+            rels += struct.pack('<II', offset + j * 4, (1 << 8) | R_ARM_ABS32)
+
+    progbits = rng.randbytes(progbits_size)
+
+    # The symbol table is section 4 and the string table is section 5
+    sections = [
+        ('.progbits', SHT_PROGBITS, 0, progbits, 0, 0, 0),
+        ('.nobits', SHT_NOBITS, progbits_size, 4096, 0, 0, 0),
+        ('.rel.progbits', SHT_REL, 0, bytes(rels), 4, 1, 8),
+        ('.symtab', SHT_SYMTAB, 0, b''.join(syms), 5, 2, 16),
+        ('.strtab', SHT_STRTAB, 0, bytes(strtab.data), 0, 0, 0),
+    ]
+    write_elf(path, sections, StringTable())
+
+
+def gen_main_binary(path, rng, names):
+    strtab = StringTable()
+    syms = [bytes(16)]
+    for i, name in enumerate(names):
+        value = 0x02000000 + rng.randrange(0, 0x100000) * 4
+        # Half of the functions are Thumb functions
+        value |= i & 1
+        syms.append(symbol(strtab.add(name), value, 4, STB_GLOBAL, STT_FUNC,
+                           STV_DEFAULT, 1))
+
+    sections = [
+        ('.text', SHT_PROGBITS, 0x02000000, bytes(4), 0, 0, 0),
+        ('.symtab', SHT_SYMTAB, 0, b''.join(syms), 3, 1, 16),
+        ('.strtab', SHT_STRTAB, 0, bytes(strtab.data), 0, 0, 0),
+    ]
+    write_elf(path, sections, StringTable())
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Generate synthetic ELF files for dsltool.')
+    parser.add_argument('output', help='Directory to create')
+    parser.add_argument('--symbols', type=int, default=100000,
+                        help='Number of symbols of the library')
+    parser.add_argument('--main-symbols', type=int, default=100000,
+                        help='Number of symbols of the main binary')
+    parser.add_argument('--progbits-size', type=int, default=1024 * 1024,
+                        help='Size of the code and data of the library')
+    parser.add_argument('--pointer-tables', type=int, default=0,
+                        help='Number of tables of pointers of the library')
+    parser.add_argument('--seed', type=int, default=1, help='Seed of the contents')
+    args = parser.parse_args()
+
+    if os.path.exists(args.output):
+        print(f'{args.output} already exists', file=sys.stderr)
+        return 1
+
+    os.makedirs(args.output)
+    rng = random.Random(args.seed)
+
+    main_names = [f'_ZN4game6system{i}6updateEv' for i in range(args.main_symbols)]
+    # Only some of the functions of the main binary are used by the library
+    imported = main_names[:max(1, args.main_symbols // 4)]
+
+    gen_library(os.path.join(args.output, 'library.elf'), rng, args.symbols,
+                imported, args.progbits_size, args.pointer_tables)
+    gen_main_binary(os.path.join(args.output, 'main.elf'), rng, main_names)
+
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
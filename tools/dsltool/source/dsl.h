@@ -43,7 +43,8 @@
 ///     +====================+=============+================================+
 ///     | Magic              | uint32_t    | 0x304C5344 == 'DSL0'           |
 ///     +--------------------+-------------+--------------------------------+
-///     | Version            | uint8_t     | Current version: 0             |
+///     | Version            | uint8_t     | 0, or 1 if any section type    |
+///     |                    |             | added in version 1 is used.    |
 ///     +--------------------+-------------+--------------------------------+
 ///     | Number of sections | uint8_t     |                                |
 ///     +--------------------+-------------+--------------------------------+
@@ -56,20 +57,36 @@
 /// all sections stored in the file.
 ///
 ///     +====================+=============+================================+
-///     | Address            | uint16_t    | As seen by the DSP (in words). |
+///     | Address            | uint32_t    | Address in the address space   |
+///     |                    |             | of the library.                |
 ///     +--------------------+-------------+--------------------------------+
-///     | Size (in bytes)    | uint16_t    |                                |
-///     +--------------------+-------------+--------------------------------+
-///     | Section type       | uint8_t     | See DSL_SEGMENT_*              |
-///     +--------------------+-------------+--------------------------------+
-///     | Unused             | uint8_t[3]  | Unused, set to zero.           |
+///     | Size (in bytes)    | uint32_t    | Uncompressed size.             |
 ///     +--------------------+-------------+--------------------------------+
 ///     | Data offset        | uint32_t    | Offset to the section data     |
 ///     |                    |             | from the start of the file.    |
+///     +--------------------+-------------+--------------------------------+
+///     | Section type       | uint8_t     | See DSL_SEGMENT_*              |
+///     +--------------------+-------------+--------------------------------+
+///     | Compressed size    | uint8_t[3]  | Size of the data in the file   |
+///     |                    |             | of compressed sections (little |
+///     |                    |             | endian). Zero otherwise.       |
 ///     +====================+=============+================================+
 ///
 /// Section data: The data of the sections is stored right after the array of
 /// DSL section headers.
+///
+/// The symbol hash section is optional. It isn't loaded to the address space of
+/// the library (its address is 0), it's only used to look for symbols.
+///
+/// Relocations may be stored as a packed relocations section instead of a
+/// relocations section. Its address is 0 too.
+///
+/// A prelink section means that the progbits section has been relocated ahead
+/// of time for a specific load address, see DSL_SEGMENT_PRELINK.
+///
+/// The progbits section may be stored compressed, see DSL_SEGMENT_PROGBITS_LZ77.
+///
+/// Files that have any of these sections use version 1 of the format.
 
 /// DSL section header description
 typedef struct {
@@ -77,19 +94,73 @@ typedef struct {
     uint32_t size;          ///< Size in bytes
     uint32_t data_offset;   ///< Offset of the file to the data of the section
     uint8_t type;           ///< One of the DSL_SEGMENT_* defines.
-    uint8_t unused[3];      ///< Unused. Set to zero
+    uint8_t compressed_size[3]; ///< Size of compressed data. Zero if not compressed
 } dsl_section_header;
 
 static_assert(sizeof(dsl_section_header) == 16);
 
+/// Returns the number of bytes of the data of a section stored in the file.
+static inline uint32_t dsl_section_file_size(const dsl_section_header *section)
+{
+    uint32_t compressed_size = section->compressed_size[0]
+                             | (section->compressed_size[1] << 8)
+                             | (section->compressed_size[2] << 16);
+
+    if (compressed_size != 0)
+        return compressed_size;
+
+    return section->size;
+}
+
 #define DSL_SEGMENT_NOBITS      0
 #define DSL_SEGMENT_PROGBITS    1
 #define DSL_SEGMENT_RELOCATIONS 2
+#define DSL_SEGMENT_SYMBOL_HASH 3 ///< Since version 1
+#define DSL_SEGMENT_PACKED_RELOCATIONS 4 ///< Since version 1
+#define DSL_SEGMENT_PRELINK     5 ///< Since version 1
+#define DSL_SEGMENT_PROGBITS_LZ77 6 ///< Since version 1
+
+/// DSL prelink section: It has no data (its size and data offset are 0). The
+/// address field of the section header is the load address that was used to
+/// prelink the library. All symbols of the main binary have been resolved, and
+/// the relocations have been applied to the progbits section as if the library
+/// had been loaded at that address.
+///
+/// If the loader places the library at the prelink address it only needs to
+/// apply the R_ARM_TLS_LE32 relocations (they depend on the thread-local
+/// storage of the main binary), and it can skip all other relocations.
+///
+/// If the library is loaded at a different address, the loader must use the
+/// difference between both addresses (delta = load address - prelink address)
+/// instead of the normal relocation rules:
+///
+/// - R_ARM_ABS32 and R_ARM_TARGET1 against symbols of the library: Add delta to
+///   the word. Against symbols of the main binary: Nothing to do.
+/// - R_ARM_CALL, R_ARM_JUMP24 and R_ARM_THM_CALL against symbols of the main
+///   binary: Subtract delta from the offset of the branch. Against symbols of
+///   the library: Nothing to do.
+/// - R_ARM_TLS_LE32: Apply it normally.
+/// - R_ARM_V4BX: Nothing to do.
+
+/// DSL compressed progbits section: It's loaded like a progbits section, but
+/// the data in the file is compressed in the LZ77 format of the BIOS (type
+/// 0x10). The size field of the section header is the uncompressed size, and
+/// the compressed size is the size of the data in the file, padded to 4 bytes.
+///
+/// The data can be decompressed with swiDecompressLZSSWram() after reading it,
+/// but it's better to decompress it while it's read from the file (with
+/// decompressStream(), for example) to the memory allocated for the library.
+/// The data is meant to be decompressed to main RAM: matches can copy data from
+/// the previous byte, so it can't be decompressed to VRAM.
+///
+/// Note that the end of the data of this section in the file isn't the data
+/// offset plus the size. Use dsl_section_file_size() to find it (for example,
+/// to locate the symbol table).
 
 /// DSL file header
 typedef struct {
     uint32_t magic;             ///< Magic number: DSL_MAGIC
-    uint8_t version;            ///< Version number (currently 0)
+    uint8_t version;            ///< Version number (0 or 1)
     uint8_t num_sections;       ///< Number of sections in the file
     uint8_t unused[2];          ///< Unused. Set to zero
     uint32_t addr_space_size;   ///< Size of the address space used by the DSL file
@@ -144,4 +215,133 @@ typedef struct {
 
 static_assert(sizeof(dsl_symbol_table) == 4);
 
+/// DSL symbol hash table: Data of the DSL_SEGMENT_SYMBOL_HASH section. It is a
+/// hash table of the public symbols, similar to the one in the .gnu.hash
+/// section of ELF files, so that they can be found without comparing strings
+/// with all the other symbols. It doesn't replace the symbol table.
+///
+///     +====================+=============+================================+
+///     | Number of buckets  | uint32_t    | At least 1.                    |
+///     +--------------------+-------------+--------------------------------+
+///     | Bloom filter size  | uint32_t    | In words. A power of two.      |
+///     +--------------------+-------------+--------------------------------+
+///     | Bloom filter shift | uint32_t    |                                |
+///     +--------------------+-------------+--------------------------------+
+///     | Number of symbols  | uint32_t    | Symbols in the hash table.     |
+///     +====================+=============+================================+
+///     | Bloom filter       | uint32_t[]  | Bloom filter size entries.     |
+///     +--------------------+-------------+--------------------------------+
+///     | Buckets            | uint32_t[]  | Index of the first chain entry |
+///     |                    |             | of each bucket, or             |
+///     |                    |             | DSL_HASH_EMPTY_BUCKET.         |
+///     +--------------------+-------------+--------------------------------+
+///     | Chain              | uint32_t[]  | Hash of each symbol. Bit 0 is  |
+///     |                    |             | set in the last entry of a     |
+///     |                    |             | bucket.                        |
+///     +--------------------+-------------+--------------------------------+
+///     | Symbol indices     | uint16_t[]  | Index in the symbol table of   |
+///     |                    |             | each chain entry. Padded to a  |
+///     |                    |             | multiple of 4 bytes.           |
+///     +====================+=============+================================+
+///
+/// To look for a name:
+///
+/// 1. Calculate h = dsl_symbol_hash(name).
+/// 2. Take the word at index (h / 32) % bloom_size from the bloom filter. If
+///    bits (h % 32) and ((h >> bloom_shift) % 32) aren't both set, the symbol
+///    isn't in the table.
+/// 3. Take i = buckets[h % num_buckets]. If it's DSL_HASH_EMPTY_BUCKET, the
+///    symbol isn't in the table.
+/// 4. If (chain[i] | 1) == (h | 1), compare the name with the name of symbol
+///    symbol_index[i] of the symbol table. If they are the same, it has been
+///    found. If not, and bit 0 of chain[i] is clear, increment i and repeat
+///    this step. If it is set, the symbol isn't in the table.
+
+/// DSL symbol hash table header
+typedef struct {
+    uint32_t num_buckets;   ///< Number of buckets
+    uint32_t bloom_size;    ///< Number of words of the bloom filter
+    uint32_t bloom_shift;   ///< Shift used to get the second bloom filter bit
+    uint32_t num_symbols;   ///< Number of symbols in the chain
+    uint32_t data[];        ///< Bloom filter, buckets, chain and indices
+} dsl_symbol_hash_table;
+
+static_assert(sizeof(dsl_symbol_hash_table) == 16);
+
+/// Value of empty buckets of the symbol hash table
+#define DSL_HASH_EMPTY_BUCKET   0xFFFFFFFF
+
+/// Hash function used by the symbol hash table (the same one as in .gnu.hash).
+static inline uint32_t dsl_symbol_hash(const char *name)
+{
+    uint32_t h = 5381;
+
+    for (const unsigned char *c = (const unsigned char *)name; *c != '\0'; c++)
+        h = (h << 5) + h + *c;
+
+    return h;
+}
+
+/// DSL packed relocations: Data of the DSL_SEGMENT_PACKED_RELOCATIONS section.
+/// It contains the same relocations as a relocations section, but they are
+/// grouped by type and sorted by offset, and they take less space.
+///
+///     +====================+=============+================================+
+///     | Number of groups   | uint32_t    |                                |
+///     +====================+=============+================================+
+///
+/// Groups: Stored one after the other after the header.
+///
+///     +====================+=============+================================+
+///     | Relocation type    | uint8_t     | R_ARM_* value.                 |
+///     +--------------------+-------------+--------------------------------+
+///     | Encoding           | uint8_t     | DSL_PACKED_REL_*               |
+///     +--------------------+-------------+--------------------------------+
+///     | Unused             | uint8_t[2]  | Unused, set to zero.           |
+///     +--------------------+-------------+--------------------------------+
+///     | Number of entries  | uint32_t    |                                |
+///     +--------------------+-------------+--------------------------------+
+///     | Size of the data   | uint32_t    | In bytes, a multiple of 4.     |
+///     +====================+=============+================================+
+///     | Entries            |             | Data of the group.             |
+///     +====================+=============+================================+
+///
+/// DSL_PACKED_REL_BITMAP is only used for R_ARM_ABS32 relocations against a
+/// symbol of the library with value 0 (normally the section symbol). Applying
+/// them just means adding the load address of the library to the word at the
+/// offset of the relocation. Each entry is a run of up to 32 words:
+///
+///     +====================+=============+================================+
+///     | Offset             | uint32_t    | Offset of the first word.      |
+///     +--------------------+-------------+--------------------------------+
+///     | Bitmap             | uint32_t    | Bit N set if the word at       |
+///     |                    |             | offset + 4 * N is relocated.   |
+///     +====================+=============+================================+
+///
+/// DSL_PACKED_REL_DELTA is used for all other relocations. Entries are sorted
+/// by offset, and each one is a pair of ULEB128 values (7 bits per byte, least
+/// significant bits first, bit 7 set in all bytes except for the last one):
+///
+///     +====================+=============+================================+
+///     | Offset delta       | ULEB128     | Difference with the offset of  |
+///     |                    |             | the previous entry of the      |
+///     |                    |             | group (or with 0).             |
+///     +--------------------+-------------+--------------------------------+
+///     | Symbol index       | ULEB128     | Index in the symbol table.     |
+///     +====================+=============+================================+
+
+/// DSL packed relocations group header
+typedef struct {
+    uint8_t type;       ///< Relocation type (R_ARM_*)
+    uint8_t encoding;   ///< One of the DSL_PACKED_REL_* defines
+    uint8_t unused[2];  ///< Unused. Set to zero
+    uint32_t count;     ///< Number of entries
+    uint32_t size;      ///< Size of the entries in bytes
+} dsl_packed_rel_group;
+
+static_assert(sizeof(dsl_packed_rel_group) == 12);
+
+#define DSL_PACKED_REL_BITMAP   0 ///< Runs of words relative to the load address
+#define DSL_PACKED_REL_DELTA    1 ///< Offset deltas and symbol indices
+
 #endif // LIBNDS_DSL_H__
@@ -0,0 +1,145 @@
+// SPDX-License-Identifier: Zlib
+//
+// Copyright (C) 2026 Antonio Niño Díaz
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "log.h"
+#include "lz77.h"
+
+// Libraries are always decompressed to main RAM, so matches can copy from the
+// previous byte (that doesn't work when decompressing to VRAM).
+#define LZ_MIN_LEN      3
+#define LZ_MAX_LEN      18
+#define LZ_MIN_DISP     1
+#define LZ_MAX_DISP     4096
+#define LZ_HASH_BITS    16
+
+static uint32_t lz_hash(const uint8_t *p)
+{
+    uint32_t v = (p[0] << 16) | (p[1] << 8) | p[2];
+    return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+uint8_t *lz77_compress(const uint8_t *src, size_t size, size_t *out_size)
+{
+    if (size > LZ77_MAX_SIZE)
+        return NULL;
+
+    // Longest match at each position, found with hash chains
+    uint8_t *len = calloc(size + 1, 1);
+    uint16_t *disp = calloc(size + 1, sizeof(uint16_t));
+    int32_t *prev = malloc((size + 1) * sizeof(int32_t));
+    int32_t *head = malloc((1 << LZ_HASH_BITS) * sizeof(int32_t));
+    // Cost in bits of the rest of the input from each position
+    uint64_t *cost = malloc((size + 1) * sizeof(uint64_t));
+    uint8_t *dst = malloc(4 + size + (size + 7) / 8 + 4);
+
+    if (!len || !disp || !prev || !head || !cost || !dst)
+    {
+        ERROR("Not enough memory to compress data\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for (size_t i = 0; i < (1 << LZ_HASH_BITS); i++)
+        head[i] = -1;
+
+    for (size_t i = 0; i + LZ_MIN_LEN <= size; i++)
+    {
+        uint32_t h = lz_hash(&src[i]);
+        size_t max = (size - i < LZ_MAX_LEN) ? size - i : LZ_MAX_LEN;
+
+        for (int32_t j = head[h]; j >= 0; j = prev[j])
+        {
+            size_t d = i - j;
+            if (d > LZ_MAX_DISP)
+                break;
+            if (d < LZ_MIN_DISP)
+                continue;
+
+            size_t l = 0;
+            while ((l < max) && (src[j + l] == src[i + l]))
+                l++;
+
+            if (l > len[i])
+            {
+                len[i] = l;
+                disp[i] = d;
+                if (l == max)
+                    break;
+            }
+        }
+
+        prev[i] = head[h];
+        head[h] = i;
+    }
+
+    // Optimal parse: a literal costs 9 bits and a match costs 17 bits
+    cost[size] = 0;
+    for (size_t i = size; i-- > 0; )
+    {
+        uint64_t best = cost[i + 1] + 9;
+        uint8_t best_len = 0;
+
+        for (size_t l = LZ_MIN_LEN; l <= len[i]; l++)
+        {
+            if (cost[i + l] + 17 < best)
+            {
+                best = cost[i + l] + 17;
+                best_len = l;
+            }
+        }
+
+        cost[i] = best;
+        len[i] = best_len;
+    }
+
+    // Header: Type and uncompressed size
+    dst[0] = 0x10;
+    dst[1] = size & 0xFF;
+    dst[2] = (size >> 8) & 0xFF;
+    dst[3] = (size >> 16) & 0xFF;
+
+    size_t out = 4;
+    size_t flags = 0;
+    int item = 8;
+
+    for (size_t i = 0; i < size; )
+    {
+        if (item == 8)
+        {
+            flags = out++;
+            dst[flags] = 0;
+            item = 0;
+        }
+
+        if (len[i] != 0)
+        {
+            size_t v = ((len[i] - LZ_MIN_LEN) << 12) | (disp[i] - 1);
+            dst[flags] |= 0x80 >> item;
+            dst[out++] = v >> 8;
+            dst[out++] = v & 0xFF;
+            i += len[i];
+        }
+        else
+        {
+            dst[out++] = src[i++];
+        }
+
+        item++;
+    }
+
+    while (out & 3)
+        dst[out++] = 0;
+
+    *out_size = out;
+
+    free(len);
+    free(disp);
+    free(prev);
+    free(head);
+    free(cost);
+    return dst;
+}
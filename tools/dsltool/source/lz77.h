@@ -0,0 +1,20 @@
+// SPDX-License-Identifier: Zlib
+//
+// Copyright (C) 2026 Antonio Niño Díaz
+
+#ifndef LZ77_H__
+#define LZ77_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Maximum size of the uncompressed data (the size is stored in 24 bits)
+#define LZ77_MAX_SIZE   0xFFFFFF
+
+// Compresses data in the LZ77 format of the BIOS of the GBA/DS (type 0x10).
+// Returns a buffer allocated with malloc() and writes its size to "out_size",
+// which is padded to a multiple of 4 bytes. Returns NULL if the input is too
+// big.
+uint8_t *lz77_compress(const uint8_t *src, size_t size, size_t *out_size);
+
+#endif // LZ77_H__
@@ -11,7 +11,10 @@
 #include "elf.h"
 #include "dsl.h"
 #include "log.h"
+#include "lz77.h"
 #include "main_binary.h"
+#include "prelink.h"
+#include "reloc_pack.h"
 #include "sym_table.h"
 
 // Useful commands to analyze ELF files:
@@ -24,13 +27,18 @@
 
 void usage(void)
 {
-    INFO("Usage: dsltool -i input.elf -o output.dsl [-m main_binary.elf] [-v]\n"
+    INFO("Usage: dsltool -i input.elf -o output.dsl [-m main_binary.elf]\n"
+         "               [-b address] [-r] [-s] [-z] [-v]\n"
          "\n"
          "  -i input.elf       ELF file of the dynamic library.\n"
          "  -o output.dsl      Path to DSL file to be created.\n"
          "  -m main_binary.elf Optional main binary ELF file to resolve symbols\n"
+         "  -b address         Prelink to this address, needs -m (DSL version 1)\n"
+         "  -r                 Pack relocations (DSL version 1)\n"
+         "  -s                 Add a hash table of public symbols (DSL version 1)\n"
          "  -u                 Ignore unresolved symbols\n"
          "  -v                 Enable verbose logging\n"
+         "  -z                 Compress progbits with LZ77 (DSL version 1)\n"
          "  -V                 Print version string and exit\n"
     );
 }
@@ -40,6 +48,7 @@ typedef struct {
     uint32_t size;
     uint32_t type;
     void *data;
+    uint32_t compressed_size; // Size of "data" if the section is compressed
 } elf_section_info;
 
 #define MAX_SECTIONS 40
@@ -60,6 +69,11 @@ int main(int argc, char *argv[])
     const char *out_file = NULL;
     const char *main_binary_file = NULL;
     bool ignore_unresolved_symbols = false;
+    bool symbol_hash = false;
+    bool pack_relocations = false;
+    bool prelink = false;
+    bool compress = false;
+    uint32_t prelink_base = 0;
 
     for (int i = 1; i < argc; i++)
     {
@@ -81,6 +95,29 @@ int main(int argc, char *argv[])
             if (i < argc)
                 main_binary_file = argv[i];
         }
+        else if (strcmp(argv[i], "-b") == 0)
+        {
+            i++;
+            if (i < argc)
+            {
+                char *end;
+                prelink_base = strtoul(argv[i], &end, 0);
+                if ((*end != '\0') || (prelink_base & 3))
+                {
+                    ERROR("Invalid prelink address: %s\n", argv[i]);
+                    return -1;
+                }
+                prelink = true;
+            }
+        }
+        else if (strcmp(argv[i], "-r") == 0)
+        {
+            pack_relocations = true;
+        }
+        else if (strcmp(argv[i], "-s") == 0)
+        {
+            symbol_hash = true;
+        }
         else if (strcmp(argv[i], "-u") == 0)
         {
             ignore_unresolved_symbols = true;
@@ -94,6 +131,10 @@ int main(int argc, char *argv[])
         {
             set_log_level(LOG_VERBOSE);
         }
+        else if (strcmp(argv[i], "-z") == 0)
+        {
+            compress = true;
+        }
         else
         {
             ERROR("Unknown argument: %s\n", argv[i]);
@@ -116,6 +157,13 @@ int main(int argc, char *argv[])
         return -1;
     }
 
+    if (prelink && (main_binary_file == NULL))
+    {
+        ERROR("Prelinking requires the main binary ELF file\n");
+        usage();
+        return -1;
+    }
+
     VERBOSE("\n"
             "Loading main ELF\n"
             "----------------\n"
@@ -172,6 +220,15 @@ int main(int argc, char *argv[])
 
         uintptr_t address = shdr->sh_addr;
 
+        // Leave space for the symbol hash and prelink sections
+        if (read_sections == MAX_SECTIONS - 2)
+        {
+            ERROR("Too many sections\n");
+            free(hdr);
+            main_binary_free();
+            return -1;
+        }
+
         int type = -1;
 
         if (strcmp(name, ".nobits") == 0)
@@ -199,6 +256,7 @@ int main(int argc, char *argv[])
         sections[read_sections].size = size;
         sections[read_sections].type = type;
         sections[read_sections].data = data;
+        sections[read_sections].compressed_size = 0;
 
         uint32_t end_address = address + size;
         if (end_address > max_address)
@@ -333,6 +391,10 @@ int main(int argc, char *argv[])
 
     INFO("Creating file: %s\n", out_file);
 
+    void *hash_data = NULL;
+    void *packed_rel_data = NULL;
+    void *compressed_data = NULL;
+
     FILE *f_dsl = fopen(out_file, "wb");
     if (f_dsl == NULL)
     {
@@ -342,22 +404,6 @@ int main(int argc, char *argv[])
         return -1;
     }
 
-    // Write header
-
-    dsl_header header = {
-        .magic = DSL_MAGIC,
-        .version = 0,
-        .num_sections = read_sections,
-        .unused = {0},
-        .addr_space_size = max_address,
-    };
-
-    if (fwrite(&header, sizeof(dsl_header), 1, f_dsl) != 1)
-    {
-        ERROR("Failed to write DSL header\n");
-        goto error;
-    }
-
     // Check relocations to see that there are unsupported types
 
     int progbits_index = -1;
@@ -462,6 +508,40 @@ int main(int argc, char *argv[])
             rel[r].r_offset = offset;
             rel[r].r_info  = type | (new_index << 8);
         }
+
+        if (prelink)
+        {
+            VERBOSE("Prelinking to 0x%08X...\n", prelink_base);
+
+            if (prelink_progbits(sections[progbits_index].data,
+                                 sections[progbits_index].address,
+                                 sections[progbits_index].size,
+                                 rel, num_rel, prelink_base) != 0)
+            {
+                ERROR("Failed to prelink library\n");
+                goto error;
+            }
+        }
+
+        if (pack_relocations)
+        {
+            size_t packed_size;
+
+            VERBOSE("Packing relocations...\n");
+
+            if (packed_rel_data != NULL)
+            {
+                ERROR("Only one relocations section can be packed\n");
+                goto error;
+            }
+
+            packed_rel_data = reloc_pack(rel, num_rel, &packed_size);
+
+            sections[i].address = 0;
+            sections[i].size = packed_size;
+            sections[i].type = DSL_SEGMENT_PACKED_RELOCATIONS;
+            sections[i].data = packed_rel_data;
+        }
     }
 
     if (!symbols_cleared)
@@ -475,6 +555,98 @@ int main(int argc, char *argv[])
         sym_print_table();
     }
 
+    if (symbol_hash)
+    {
+        size_t hash_size;
+
+        VERBOSE("Generating symbol hash table...\n");
+
+        hash_data = sym_table_build_hash(&hash_size);
+
+        sections[read_sections].address = 0;
+        sections[read_sections].size = hash_size;
+        sections[read_sections].type = DSL_SEGMENT_SYMBOL_HASH;
+        sections[read_sections].data = hash_data;
+        sections[read_sections].compressed_size = 0;
+        read_sections++;
+    }
+
+    if (prelink)
+    {
+        // This section has no data, the address is the prelink address
+        sections[read_sections].address = prelink_base;
+        sections[read_sections].size = 0;
+        sections[read_sections].type = DSL_SEGMENT_PRELINK;
+        sections[read_sections].data = NULL;
+        sections[read_sections].compressed_size = 0;
+        read_sections++;
+    }
+
+    if (compress)
+    {
+        // This is done after prelinking because it modifies the data
+        elf_section_info *progbits = &sections[progbits_index];
+        size_t compressed_size;
+
+        VERBOSE("Compressing progbits...\n");
+
+        compressed_data = lz77_compress(progbits->data, progbits->size,
+                                        &compressed_size);
+        if (compressed_data == NULL)
+        {
+            ERROR("Progbits section is too big to be compressed\n");
+            goto error;
+        }
+
+        INFO("Progbits compressed: 0x%X -> 0x%zX bytes\n", progbits->size,
+             compressed_size);
+
+        // The loader would need to read the whole section and decompress it,
+        // so only keep the compressed data if it saves something.
+        if (compressed_size < progbits->size)
+        {
+            progbits->type = DSL_SEGMENT_PROGBITS_LZ77;
+            progbits->data = compressed_data;
+            progbits->compressed_size = compressed_size;
+        }
+        else
+        {
+            INFO("Compressed data isn't smaller. Saving it uncompressed\n");
+        }
+    }
+
+    // Write header. The symbol hash table and the prelink information have been
+    // saved as additional sections after all the sections of the ELF file. The
+    // version depends on the final types of the sections: -z may have left the
+    // progbits section uncompressed, for example.
+
+    unsigned int version = 0;
+
+    for (int i = 0; i < read_sections; i++)
+    {
+        if ((sections[i].type == DSL_SEGMENT_SYMBOL_HASH) ||
+            (sections[i].type == DSL_SEGMENT_PACKED_RELOCATIONS) ||
+            (sections[i].type == DSL_SEGMENT_PRELINK) ||
+            (sections[i].type == DSL_SEGMENT_PROGBITS_LZ77))
+        {
+            version = 1;
+        }
+    }
+
+    dsl_header header = {
+        .magic = DSL_MAGIC,
+        .version = version,
+        .num_sections = read_sections,
+        .unused = {0},
+        .addr_space_size = max_address,
+    };
+
+    if (fwrite(&header, sizeof(dsl_header), 1, f_dsl) != 1)
+    {
+        ERROR("Failed to write DSL header\n");
+        goto error;
+    }
+
     // Write section headers
 
     VERBOSE("Writing %d sections\n", read_sections);
@@ -486,23 +658,38 @@ int main(int argc, char *argv[])
 
     for (int i = 0; i < read_sections; i++)
     {
-        uint32_t offset = (sections[i].type == DSL_SEGMENT_NOBITS) ?
-                          0 : current_section_offset;
+        bool has_data = (sections[i].type != DSL_SEGMENT_NOBITS) &&
+                        (sections[i].type != DSL_SEGMENT_PRELINK);
+
+        uint32_t offset = has_data ? current_section_offset : 0;
+
+        uint32_t compressed_size = sections[i].compressed_size;
+        uint32_t file_size = (compressed_size != 0) ?
+                             compressed_size : sections[i].size;
 
         dsl_section_header section_header = {
             .address = sections[i].address,
             .size = sections[i].size,
             .data_offset = offset,
             .type = sections[i].type,
-            .unused = {0},
+            .compressed_size = {
+                compressed_size & 0xFF,
+                (compressed_size >> 8) & 0xFF,
+                (compressed_size >> 16) & 0xFF,
+            },
         };
 
-        if (sections[i].type != DSL_SEGMENT_NOBITS)
+        if (has_data)
         {
             VERBOSE("Section %d: offset 0x%X, 0x%X bytes\n",
-                   i, offset, sections[i].size);
+                   i, offset, file_size);
 
-            current_section_offset += sections[i].size;
+            current_section_offset += file_size;
+        }
+        else if (sections[i].type == DSL_SEGMENT_PRELINK)
+        {
+            VERBOSE("Section %d: prelink, address 0x%08X\n", i,
+                    sections[i].address);
         }
         else
         {
@@ -520,7 +707,8 @@ int main(int argc, char *argv[])
 
     for (int i = 0; i < read_sections; i++)
     {
-        if (sections[i].type == DSL_SEGMENT_NOBITS)
+        if ((sections[i].type == DSL_SEGMENT_NOBITS) ||
+            (sections[i].type == DSL_SEGMENT_PRELINK))
         {
             // Nothing to write to the file
         }
@@ -534,10 +722,40 @@ int main(int argc, char *argv[])
                 goto error;
             }
         }
+        else if (sections[i].type == DSL_SEGMENT_PROGBITS_LZ77)
+        {
+            VERBOSE("Writing data of section %d (compressed progbits)\n", i);
+
+            if (fwrite(sections[i].data, sections[i].compressed_size, 1, f_dsl) != 1)
+            {
+                ERROR("Failed to write DSL data for section %d\n", i);
+                goto error;
+            }
+        }
         else if (sections[i].type == DSL_SEGMENT_RELOCATIONS)
         {
             VERBOSE("Writing data of section %d (relocations)\n", i);
 
+            if (fwrite(sections[i].data, sections[i].size, 1, f_dsl) != 1)
+            {
+                ERROR("Failed to write DSL data for section %d\n", i);
+                goto error;
+            }
+        }
+        else if (sections[i].type == DSL_SEGMENT_PACKED_RELOCATIONS)
+        {
+            VERBOSE("Writing data of section %d (packed relocations)\n", i);
+
+            if (fwrite(sections[i].data, sections[i].size, 1, f_dsl) != 1)
+            {
+                ERROR("Failed to write DSL data for section %d\n", i);
+                goto error;
+            }
+        }
+        else if (sections[i].type == DSL_SEGMENT_SYMBOL_HASH)
+        {
+            VERBOSE("Writing data of section %d (symbol hash)\n", i);
+
             if (fwrite(sections[i].data, sections[i].size, 1, f_dsl) != 1)
             {
                 ERROR("Failed to write DSL data for section %d\n", i);
@@ -546,6 +764,13 @@ int main(int argc, char *argv[])
         }
     }
 
+    free(hash_data);
+    hash_data = NULL;
+    free(packed_rel_data);
+    packed_rel_data = NULL;
+    free(compressed_data);
+    compressed_data = NULL;
+
     // Save symbol table to file
 
     VERBOSE("Saving symbol table...\n");
@@ -571,6 +796,9 @@ int main(int argc, char *argv[])
     return 0;
 
 error:
+    free(hash_data);
+    free(packed_rel_data);
+    free(compressed_data);
     free(hdr);
     main_binary_free();
     fclose(f_dsl);
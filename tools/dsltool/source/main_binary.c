@@ -10,6 +10,7 @@
 
 #include "elf.h"
 #include "log.h"
+#include "name_map.h"
 
 static Elf32_Ehdr *hdr = NULL;
 
@@ -18,6 +19,9 @@ static size_t symtab_size = 0;
 
 static int strtab_index = -1;
 
+// Map from symbol names to indices in the symbol table
+static name_map symbols_by_name;
+
 int main_binary_load(const char *path)
 {
     hdr = elf_load(path);
@@ -56,10 +60,29 @@ int main_binary_load(const char *path)
     {
         ERROR("Can't find strab or symtab\n");
         free(hdr);
+        hdr = NULL;
         return -1;
     }
 
-    VERBOSE("Found %zu symbols\n", symtab_size / sizeof(Elf32_Sym));
+    const Elf32_Sym *sym = elf_section_data(hdr, symtab_index);
+    size_t sym_num = symtab_size / sizeof(Elf32_Sym);
+
+    VERBOSE("Found %zu symbols\n", sym_num);
+
+    name_map_init(&symbols_by_name, sym_num);
+
+    for (size_t s = 0; s < sym_num; s++, sym++)
+    {
+        uint8_t type = ELF_ST_TYPE(sym->st_info);
+
+        // Only save addresses of functions and objects, not sections
+        if ((type != STT_FUNC) && (type != STT_OBJECT) && (type != STT_TLS))
+            continue;
+
+        // If a name is repeated, the first symbol with that name is used
+        const char *sym_name = elf_get_string_strtab(hdr, strtab_index, sym->st_name);
+        name_map_add(&symbols_by_name, sym_name, s);
+    }
 
     return 0;
 }
@@ -74,31 +97,17 @@ uint32_t main_binary_get_symbol_value(const char *name)
     if (hdr == NULL)
         return UINT32_MAX;
 
-    const Elf32_Sym *sym = elf_section_data(hdr, symtab_index);
-    size_t sym_num = symtab_size / sizeof(Elf32_Sym);
-
-    for (size_t s = 0; s < sym_num; s++, sym++)
-    {
-        uint8_t type = ELF_ST_TYPE(sym->st_info);
-
-        const char *sym_name;
-
-        // Only save addresses of functions and objects, not sections
-        if ((type != STT_FUNC) && (type != STT_OBJECT) && (type != STT_TLS))
-            continue;
-
-        sym_name = elf_get_string_strtab(hdr, strtab_index, sym->st_name);
-
-        if (strcmp(sym_name, name) != 0)
-            continue;
+    int index = name_map_find(&symbols_by_name, name);
+    if (index == -1)
+        return UINT32_MAX;
 
-        return sym->st_value;
-    }
+    const Elf32_Sym *sym = elf_section_data(hdr, symtab_index);
 
-    return UINT32_MAX;
+    return sym[index].st_value;
 }
 
 void main_binary_free(void)
 {
+    name_map_free(&symbols_by_name);
     free(hdr);
 }
@@ -0,0 +1,113 @@
+// SPDX-License-Identifier: Zlib
+//
+// Copyright (C) 2026 Antonio Niño Díaz
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "log.h"
+#include "name_map.h"
+
+// FNV-1a
+static uint32_t name_map_hash(const char *name)
+{
+    uint32_t hash = 2166136261u;
+
+    for (const unsigned char *c = (const unsigned char *)name; *c != '\0'; c++)
+        hash = (hash ^ *c) * 16777619u;
+
+    return hash;
+}
+
+static void name_map_alloc(name_map *map, size_t size)
+{
+    map->entries = calloc(size, sizeof(name_map_entry));
+    if (map->entries == NULL)
+    {
+        ERROR("Not enough memory for symbol map\n");
+        exit(EXIT_FAILURE);
+    }
+
+    map->mask = size - 1;
+    map->count = 0;
+}
+
+void name_map_init(name_map *map, size_t expected_count)
+{
+    // Keep the load factor under 50%
+    size_t size = 16;
+    while (size < expected_count * 2)
+        size *= 2;
+
+    name_map_alloc(map, size);
+}
+
+void name_map_free(name_map *map)
+{
+    free(map->entries);
+    map->entries = NULL;
+    map->mask = 0;
+    map->count = 0;
+}
+
+static name_map_entry *name_map_lookup(const name_map *map, const char *name,
+                                       uint32_t hash)
+{
+    size_t i = hash & map->mask;
+
+    while (1)
+    {
+        name_map_entry *e = &map->entries[i];
+
+        if (e->name == NULL)
+            return e;
+
+        if ((e->hash == hash) && (strcmp(e->name, name) == 0))
+            return e;
+
+        i = (i + 1) & map->mask;
+    }
+}
+
+void name_map_add(name_map *map, const char *name, int value)
+{
+    if ((map->count + 1) * 2 > map->mask + 1)
+    {
+        name_map old = *map;
+
+        name_map_alloc(map, (old.mask + 1) * 2);
+
+        for (size_t i = 0; i <= old.mask; i++)
+        {
+            name_map_entry *e = &old.entries[i];
+            if (e->name == NULL)
+                continue;
+
+            *name_map_lookup(map, e->name, e->hash) = *e;
+            map->count++;
+        }
+
+        free(old.entries);
+    }
+
+    uint32_t hash = name_map_hash(name);
+    name_map_entry *e = name_map_lookup(map, name, hash);
+
+    if (e->name != NULL)
+        return;
+
+    e->name = name;
+    e->hash = hash;
+    e->value = value;
+    map->count++;
+}
+
+int name_map_find(const name_map *map, const char *name)
+{
+    if (map->entries == NULL)
+        return -1;
+
+    name_map_entry *e = name_map_lookup(map, name, name_map_hash(name));
+
+    return (e->name == NULL) ? -1 : e->value;
+}
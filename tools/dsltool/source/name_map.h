@@ -0,0 +1,35 @@
+// SPDX-License-Identifier: Zlib
+//
+// Copyright (C) 2026 Antonio Niño Díaz
+
+#ifndef NAME_MAP_H__
+#define NAME_MAP_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Hash table that maps strings to non-negative integers. The strings aren't
+// copied, they must remain valid while the map is used.
+
+typedef struct {
+    const char *name;
+    uint32_t hash;
+    int value;
+} name_map_entry;
+
+typedef struct {
+    name_map_entry *entries;
+    size_t mask; // Number of entries minus one (a power of two)
+    size_t count;
+} name_map;
+
+void name_map_init(name_map *map, size_t expected_count);
+void name_map_free(name_map *map);
+
+// If the name is already in the map, the old value is kept
+void name_map_add(name_map *map, const char *name, int value);
+
+// Returns -1 if the name isn't in the map
+int name_map_find(const name_map *map, const char *name);
+
+#endif // NAME_MAP_H__
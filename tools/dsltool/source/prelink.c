@@ -0,0 +1,171 @@
+// SPDX-License-Identifier: Zlib
+//
+// Copyright (C) 2026 Antonio Niño Díaz
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "dsl.h"
+#include "log.h"
+#include "main_binary.h"
+#include "prelink.h"
+#include "sym_table.h"
+
+// Only the ARMv5 encodings of the instructions are used (the ARM9 of the DS is
+// an ARMv5TE CPU), so BL and BLX in Thumb state can reach +/-4 MiB.
+
+static bool prelink_arm_branch(uint32_t *insn, uint32_t pc, uint32_t target,
+                               uint8_t type)
+{
+    bool thumb = target & 1;
+    int32_t offset = (int32_t)((target & ~1u) - (pc + 8));
+
+    if ((offset < -0x2000000) || (offset > 0x1FFFFFE))
+        return false;
+
+    if (thumb)
+    {
+        // A B instruction can't switch to Thumb state. The loader uses a
+        // veneer for this, which can't be created at build time.
+        if (type == R_ARM_JUMP24)
+            return false;
+
+        // BLX (immediate), bit 24 is bit 1 of the offset
+        *insn = 0xFA000000 | (((offset >> 1) & 1) << 24)
+              | ((offset >> 2) & 0xFFFFFF);
+    }
+    else
+    {
+        if (offset & 3)
+            return false;
+
+        if (type == R_ARM_JUMP24)
+        {
+            // Keep the condition and the opcode (B or conditional BL)
+            *insn = (*insn & 0xFF000000) | ((offset >> 2) & 0xFFFFFF);
+        }
+        else
+        {
+            // BL
+            *insn = 0xEB000000 | ((offset >> 2) & 0xFFFFFF);
+        }
+    }
+
+    return true;
+}
+
+static bool prelink_thumb_call(uint16_t *insn, uint32_t pc, uint32_t target)
+{
+    bool thumb = target & 1;
+    int32_t offset;
+
+    if (thumb)
+        offset = (int32_t)((target & ~1u) - (pc + 4));
+    else // BLX uses the address of the instruction aligned to 4 bytes
+        offset = (int32_t)(target - ((pc + 4) & ~3u));
+
+    if ((offset < -0x400000) || (offset > 0x3FFFFE))
+        return false;
+
+    if (!thumb && (offset & 3))
+        return false;
+
+    insn[0] = 0xF000 | ((offset >> 12) & 0x7FF);
+    if (thumb)
+        insn[1] = 0xF800 | ((offset >> 1) & 0x7FF); // BL
+    else
+        insn[1] = 0xE800 | ((offset >> 1) & 0x7FE); // BLX
+
+    return true;
+}
+
+int prelink_progbits(void *data, uint32_t address, uint32_t size,
+                     const Elf32_Rel *rel, size_t num_rel, uint32_t base)
+{
+    uint8_t *progbits = data;
+    size_t num_applied = 0;
+
+    for (size_t r = 0; r < num_rel; r++)
+    {
+        uint8_t type = rel[r].r_info & 0xFF;
+        unsigned int index = rel[r].r_info >> 8;
+
+        // Thread-local storage offsets depend on the main binary and they are
+        // always resolved by the loader. V4BX doesn't need any change in ARMv5.
+        if ((type == R_ARM_TLS_LE32) || (type == R_ARM_V4BX))
+            continue;
+
+        uint32_t offset = rel[r].r_offset - address;
+        if ((size < 4) || (rel[r].r_offset < address) || (offset > size - 4))
+        {
+            ERROR("Relocation %zu (0x%X) is outside of progbits\n", r,
+                  rel[r].r_offset);
+            return -1;
+        }
+
+        bool in_main_binary = sym_is_in_main_binary(index);
+        uint32_t value;
+
+        if (in_main_binary)
+        {
+            value = main_binary_get_symbol_value(sym_get_name(index));
+            if (value == UINT32_MAX)
+            {
+                ERROR("Can't prelink unresolved symbol [%s]\n",
+                      sym_get_name(index));
+                return -1;
+            }
+        }
+        else
+        {
+            // Branches between functions of the library are relative, they
+            // don't depend on the load address.
+            if ((type != R_ARM_ABS32) && (type != R_ARM_TARGET1))
+                continue;
+
+            value = base;
+        }
+
+        uint32_t pc = base + rel[r].r_offset;
+        bool ok = true;
+
+        if ((type == R_ARM_ABS32) || (type == R_ARM_TARGET1))
+        {
+            // The addend is the current value of the word. For symbols of the
+            // library it already includes the address of the symbol.
+            uint32_t word;
+            memcpy(&word, progbits + offset, sizeof(word));
+            word += value;
+            memcpy(progbits + offset, &word, sizeof(word));
+        }
+        else if ((type == R_ARM_CALL) || (type == R_ARM_JUMP24))
+        {
+            uint32_t insn;
+            memcpy(&insn, progbits + offset, sizeof(insn));
+            ok = prelink_arm_branch(&insn, pc, value, type);
+            memcpy(progbits + offset, &insn, sizeof(insn));
+        }
+        else if (type == R_ARM_THM_CALL)
+        {
+            uint16_t insn[2];
+            memcpy(insn, progbits + offset, sizeof(insn));
+            ok = prelink_thumb_call(insn, pc, value);
+            memcpy(progbits + offset, insn, sizeof(insn));
+        }
+
+        if (!ok)
+        {
+            ERROR("Can't prelink relocation %zu (type %u) to [%s] at 0x%08X\n",
+                  r, type, sym_get_name(index), pc);
+            return -1;
+        }
+
+        num_applied++;
+    }
+
+    VERBOSE("Prelinked to 0x%08X: %zu of %zu relocations applied\n",
+            base, num_applied, num_rel);
+
+    return 0;
+}
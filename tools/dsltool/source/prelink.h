@@ -0,0 +1,20 @@
+// SPDX-License-Identifier: Zlib
+//
+// Copyright (C) 2026 Antonio Niño Díaz
+
+#ifndef PRELINK_H__
+#define PRELINK_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "elf.h"
+
+// Applies the relocations in "rel" to the data of the progbits section as if
+// the library was loaded at "base" (see DSL_SEGMENT_PRELINK). The symbol
+// indices of the relocations must refer to the final symbol table, and the
+// main binary must be loaded to resolve unknown symbols. Returns 0 on success.
+int prelink_progbits(void *data, uint32_t address, uint32_t size,
+                     const Elf32_Rel *rel, size_t num_rel, uint32_t base);
+
+#endif // PRELINK_H__
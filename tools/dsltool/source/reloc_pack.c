@@ -0,0 +1,249 @@
+// SPDX-License-Identifier: Zlib
+//
+// Copyright (C) 2026 Antonio Niño Díaz
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dsl.h"
+#include "log.h"
+#include "reloc_pack.h"
+#include "sym_table.h"
+
+typedef struct {
+    uint8_t *data;
+    size_t size;
+    size_t capacity;
+} pack_buffer;
+
+static void pack_reserve(pack_buffer *buf, size_t size)
+{
+    if (buf->size + size <= buf->capacity)
+        return;
+
+    size_t capacity = (buf->capacity == 0) ? 1024 : buf->capacity;
+    while (capacity < buf->size + size)
+        capacity *= 2;
+
+    uint8_t *data = realloc(buf->data, capacity);
+    if (data == NULL)
+    {
+        ERROR("Not enough memory for packed relocations\n");
+        exit(EXIT_FAILURE);
+    }
+
+    buf->data = data;
+    buf->capacity = capacity;
+}
+
+static void pack_u32(pack_buffer *buf, uint32_t value)
+{
+    pack_reserve(buf, sizeof(uint32_t));
+    memcpy(buf->data + buf->size, &value, sizeof(uint32_t));
+    buf->size += sizeof(uint32_t);
+}
+
+static void pack_uleb128(pack_buffer *buf, uint32_t value)
+{
+    pack_reserve(buf, 5);
+
+    do
+    {
+        uint8_t byte = value & 0x7F;
+        value >>= 7;
+        if (value != 0)
+            byte |= 0x80;
+        buf->data[buf->size++] = byte;
+    }
+    while (value != 0);
+}
+
+static void pack_align(pack_buffer *buf)
+{
+    pack_reserve(buf, 3);
+
+    while (buf->size & 3)
+        buf->data[buf->size++] = 0;
+}
+
+// Relocations that only need the load address of the library to be added to
+// the word they point to.
+static bool reloc_is_base_relative(const Elf32_Rel *rel)
+{
+    uint8_t type = rel->r_info & 0xFF;
+    unsigned int index = rel->r_info >> 8;
+
+    if (type != R_ARM_ABS32)
+        return false;
+
+    if (rel->r_offset & 3)
+        return false;
+
+    if (sym_is_unknown(index))
+        return false;
+
+    return sym_get_value(index) == 0;
+}
+
+static int reloc_compare_by_type(const void *p1, const void *p2)
+{
+    const Elf32_Rel *r1 = p1;
+    const Elf32_Rel *r2 = p2;
+
+    uint8_t type1 = r1->r_info & 0xFF;
+    uint8_t type2 = r2->r_info & 0xFF;
+    if (type1 != type2)
+        return (type1 < type2) ? -1 : 1;
+
+    if (r1->r_offset != r2->r_offset)
+        return (r1->r_offset < r2->r_offset) ? -1 : 1;
+
+    return 0;
+}
+
+static int reloc_compare_base_first(const void *p1, const void *p2)
+{
+    bool base1 = reloc_is_base_relative(p1);
+    bool base2 = reloc_is_base_relative(p2);
+    if (base1 != base2)
+        return base1 ? -1 : 1;
+
+    return reloc_compare_by_type(p1, p2);
+}
+
+// Saves the header of a group and returns its offset in the buffer so that
+// the number of entries and size can be set after saving its entries.
+static size_t pack_group_start(pack_buffer *buf, uint8_t type, uint8_t encoding)
+{
+    size_t offset = buf->size;
+
+    dsl_packed_rel_group group = {
+        .type = type,
+        .encoding = encoding,
+        .unused = {0},
+        .count = 0,
+        .size = 0,
+    };
+
+    pack_reserve(buf, sizeof(group));
+    memcpy(buf->data + buf->size, &group, sizeof(group));
+    buf->size += sizeof(group);
+
+    return offset;
+}
+
+static void pack_group_end(pack_buffer *buf, size_t offset, uint32_t count)
+{
+    pack_align(buf);
+
+    dsl_packed_rel_group *group = (dsl_packed_rel_group *)(buf->data + offset);
+    group->count = count;
+    group->size = buf->size - offset - sizeof(dsl_packed_rel_group);
+}
+
+void *reloc_pack(const Elf32_Rel *rel, size_t num_rel, size_t *size)
+{
+    // Relocations that aren't saved in the bitmap are copied to "rest"
+    Elf32_Rel *sorted = malloc(num_rel * sizeof(Elf32_Rel) + 1);
+    Elf32_Rel *rest = malloc(num_rel * sizeof(Elf32_Rel) + 1);
+    if ((sorted == NULL) || (rest == NULL))
+    {
+        ERROR("Not enough memory for packed relocations\n");
+        exit(EXIT_FAILURE);
+    }
+
+    memcpy(sorted, rel, num_rel * sizeof(Elf32_Rel));
+    qsort(sorted, num_rel, sizeof(Elf32_Rel), reloc_compare_base_first);
+
+    size_t num_rest = 0;
+
+    pack_buffer buf = { 0 };
+    uint32_t num_groups = 0;
+
+    pack_u32(&buf, 0); // Number of groups, set at the end
+
+    size_t r = 0;
+
+    // Bitmap group. Each run starts at the first relocation that isn't covered
+    // by the previous run. A bitmap can't hold the same offset twice, so any
+    // duplicated relocation is saved in a delta group instead.
+
+    if ((r < num_rel) && reloc_is_base_relative(&sorted[r]))
+    {
+        size_t group = pack_group_start(&buf, R_ARM_ABS32, DSL_PACKED_REL_BITMAP);
+        uint32_t count = 0;
+
+        while ((r < num_rel) && reloc_is_base_relative(&sorted[r]))
+        {
+            uint32_t start = sorted[r].r_offset;
+            uint32_t bitmap = 0;
+
+            while ((r < num_rel) && reloc_is_base_relative(&sorted[r]))
+            {
+                uint32_t delta = sorted[r].r_offset - start;
+                if (delta >= 32 * 4)
+                    break;
+
+                uint32_t bit = 1u << (delta / 4);
+                if (bitmap & bit)
+                    rest[num_rest++] = sorted[r];
+                else
+                    bitmap |= bit;
+                r++;
+            }
+
+            pack_u32(&buf, start);
+            pack_u32(&buf, bitmap);
+            count++;
+        }
+
+        pack_group_end(&buf, group, count);
+        num_groups++;
+
+        VERBOSE("Packed relocations: %zu base-relative in %u runs\n",
+                r - num_rest, count);
+    }
+
+    // Delta groups, one per relocation type
+
+    memcpy(&rest[num_rest], &sorted[r], (num_rel - r) * sizeof(Elf32_Rel));
+    num_rest += num_rel - r;
+    qsort(rest, num_rest, sizeof(Elf32_Rel), reloc_compare_by_type);
+
+    r = 0;
+
+    while (r < num_rest)
+    {
+        uint8_t type = rest[r].r_info & 0xFF;
+        size_t group = pack_group_start(&buf, type, DSL_PACKED_REL_DELTA);
+        uint32_t count = 0;
+        uint32_t last_offset = 0;
+
+        while ((r < num_rest) && ((rest[r].r_info & 0xFF) == type))
+        {
+            pack_uleb128(&buf, rest[r].r_offset - last_offset);
+            pack_uleb128(&buf, rest[r].r_info >> 8);
+            last_offset = rest[r].r_offset;
+            count++;
+            r++;
+        }
+
+        pack_group_end(&buf, group, count);
+        num_groups++;
+
+        VERBOSE("Packed relocations: %u of type %u\n", count, type);
+    }
+
+    free(sorted);
+    free(rest);
+
+    memcpy(buf.data, &num_groups, sizeof(uint32_t));
+
+    VERBOSE("Packed relocations: %zu bytes (%zu unpacked)\n",
+            buf.size, num_rel * sizeof(Elf32_Rel));
+
+    *size = buf.size;
+    return buf.data;
+}
@@ -0,0 +1,18 @@
+// SPDX-License-Identifier: Zlib
+//
+// Copyright (C) 2026 Antonio Niño Díaz
+
+#ifndef RELOC_PACK_H__
+#define RELOC_PACK_H__
+
+#include <stddef.h>
+
+#include "elf.h"
+
+// Returns a buffer allocated with malloc() with the data of a packed
+// relocations section (see DSL_SEGMENT_PACKED_RELOCATIONS) that contains the
+// same relocations as "rel". The symbol indices of the relocations must refer
+// to the final symbol table, which must be sorted already.
+void *reloc_pack(const Elf32_Rel *rel, size_t num_rel, size_t *size);
+
+#endif // RELOC_PACK_H__
@@ -12,6 +12,7 @@
 #include "dsl.h"
 #include "log.h"
 #include "main_binary.h"
+#include "name_map.h"
 
 typedef struct {
     const char *name;
@@ -24,11 +25,42 @@ typedef struct {
 
 elf_symbol_info *elf_symbols;
 size_t elf_symbols_num = 0;
+static size_t elf_symbols_max = 0;
+
+// Indices used to look for symbols. They are built the first time they are
+// needed, and they are discarded whenever the table is modified.
+static name_map index_by_name;
+static bool index_by_name_valid = false;
+static int *index_by_old_index;
+static size_t index_by_old_index_num = 0;
+
+static void sym_invalidate_indices(void)
+{
+    if (index_by_name_valid)
+    {
+        name_map_free(&index_by_name);
+        index_by_name_valid = false;
+    }
+
+    free(index_by_old_index);
+    index_by_old_index = NULL;
+    index_by_old_index_num = 0;
+}
 
 void sym_add_to_table(const char *name, uint32_t value, bool is_public, bool is_unknown)
 {
-    size_t new_size = sizeof(elf_symbol_info) * (elf_symbols_num + 1);
-    elf_symbols = realloc(elf_symbols, new_size);
+    sym_invalidate_indices();
+
+    if (elf_symbols_num == elf_symbols_max)
+    {
+        elf_symbols_max = elf_symbols_max ? elf_symbols_max * 2 : 1024;
+        elf_symbols = realloc(elf_symbols, sizeof(elf_symbol_info) * elf_symbols_max);
+        if (elf_symbols == NULL)
+        {
+            ERROR("Not enough memory for symbol table\n");
+            exit(EXIT_FAILURE);
+        }
+    }
 
     elf_symbols[elf_symbols_num].name = name;
     elf_symbols[elf_symbols_num].value = value;
@@ -66,6 +98,24 @@ bool sym_is_unknown(unsigned int index)
     return elf_symbols[index].unknown;
 }
 
+// Public symbols are always exported as symbols of the library, even if they
+// are also unknown. Only the rest of unknown symbols come from the main binary.
+bool sym_is_in_main_binary(unsigned int index)
+{
+    if (index >= elf_symbols_num)
+        return false;
+
+    return elf_symbols[index].unknown && !elf_symbols[index].public;
+}
+
+uint32_t sym_get_value(unsigned int index)
+{
+    if (index >= elf_symbols_num)
+        return 0;
+
+    return elf_symbols[index].value;
+}
+
 const char *sym_get_name(unsigned int index)
 {
     if (index >= elf_symbols_num)
@@ -82,26 +132,52 @@ int sym_get_index_from_name(const char *name)
     if (strlen(name) == 0)
         return -1;
 
-    for (unsigned int i = 0; i < elf_symbols_num; i++)
+    if (!index_by_name_valid)
     {
-        if (strcmp(elf_symbols[i].name, name) == 0)
-            return i;
+        // If a name is repeated, the first symbol with that name is used
+        name_map_init(&index_by_name, elf_symbols_num);
+        for (size_t i = 0; i < elf_symbols_num; i++)
+            name_map_add(&index_by_name, elf_symbols[i].name, i);
+
+        index_by_name_valid = true;
     }
 
-    return -1;
+    return name_map_find(&index_by_name, name);
 }
 
 int sym_get_sym_index_by_old_index(unsigned int index)
 {
-    elf_symbol_info *sym = elf_symbols;
-
-    for (size_t i = 0; i < elf_symbols_num; i++, sym++)
+    if (index_by_old_index == NULL)
     {
-        if (sym->initial_index == index)
-            return i;
+        // Initial indices are unique and smaller than the number of symbols
+        // that have been added to the table.
+        size_t num = 0;
+        for (size_t i = 0; i < elf_symbols_num; i++)
+        {
+            if (elf_symbols[i].initial_index >= num)
+                num = elf_symbols[i].initial_index + 1;
+        }
+
+        index_by_old_index = malloc(sizeof(int) * (num + 1));
+        if (index_by_old_index == NULL)
+        {
+            ERROR("Not enough memory for symbol table\n");
+            exit(EXIT_FAILURE);
+        }
+
+        for (size_t i = 0; i < num; i++)
+            index_by_old_index[i] = -1;
+
+        for (size_t i = 0; i < elf_symbols_num; i++)
+            index_by_old_index[elf_symbols[i].initial_index] = i;
+
+        index_by_old_index_num = num;
     }
 
-    return -1;
+    if (index >= index_by_old_index_num)
+        return -1;
+
+    return index_by_old_index[index];
 }
 
 static int sym_compare_entries(const void *p1, const void *p2)
@@ -114,35 +190,34 @@ static int sym_compare_entries(const void *p1, const void *p2)
 
 void sym_clear_unused(void)
 {
-    size_t i = 0;
-    while (1)
-    {
-        if (i >= elf_symbols_num)
-            break;
+    size_t kept = 0;
 
-        if ((elf_symbols[i].used) || (elf_symbols[i].public))
-        {
-            i++;
-            continue;
-        }
-
-        for (size_t j = i; j < elf_symbols_num - 1; j++)
-            elf_symbols[j] = elf_symbols[j + 1];
+    sym_invalidate_indices();
 
-        elf_symbols_num--;
+    for (size_t i = 0; i < elf_symbols_num; i++)
+    {
+        if ((elf_symbols[i].used) || (elf_symbols[i].public))
+            elf_symbols[kept++] = elf_symbols[i];
     }
+
+    elf_symbols_num = kept;
 }
 
 void sym_sort_table(void)
 {
+    sym_invalidate_indices();
+
     qsort(elf_symbols, elf_symbols_num, sizeof(elf_symbol_info), sym_compare_entries);
 }
 
 void sym_clear_table(void)
 {
+    sym_invalidate_indices();
+
     free(elf_symbols);
     elf_symbols = NULL;
     elf_symbols_num = 0;
+    elf_symbols_max = 0;
 }
 
 void sym_print_table(void)
@@ -158,8 +233,111 @@ void sym_print_table(void)
     }
 }
 
+typedef struct {
+    uint32_t hash;
+    uint32_t bucket;
+    uint16_t index;
+} hash_entry;
+
+static int sym_compare_hash_entries(const void *p1, const void *p2)
+{
+    const hash_entry *e1 = p1;
+    const hash_entry *e2 = p2;
+
+    if (e1->bucket != e2->bucket)
+        return (e1->bucket < e2->bucket) ? -1 : 1;
+
+    return (int)e1->index - (int)e2->index;
+}
+
+void *sym_table_build_hash(size_t *size)
+{
+    // Only public symbols can be found with dlsym()
+    size_t num = 0;
+    for (size_t i = 0; i < elf_symbols_num; i++)
+    {
+        if (elf_symbols[i].public)
+            num++;
+    }
+
+    uint32_t num_buckets = num / 2 + 1;
+    uint32_t bloom_size = 1;
+    while (bloom_size < num / 8)
+        bloom_size *= 2;
+    const uint32_t bloom_shift = 6;
+
+    *size = sizeof(dsl_symbol_hash_table)
+          + sizeof(uint32_t) * (bloom_size + num_buckets + num)
+          + ((sizeof(uint16_t) * num + 3) & ~3);
+
+    dsl_symbol_hash_table *table = calloc(1, *size);
+    hash_entry *entries = malloc(sizeof(hash_entry) * (num + 1));
+    if ((table == NULL) || (entries == NULL))
+    {
+        ERROR("Not enough memory for symbol hash table\n");
+        exit(EXIT_FAILURE);
+    }
+
+    table->num_buckets = num_buckets;
+    table->bloom_size = bloom_size;
+    table->bloom_shift = bloom_shift;
+    table->num_symbols = num;
+
+    uint32_t *bloom = &table->data[0];
+    uint32_t *buckets = &bloom[bloom_size];
+    uint32_t *chain = &buckets[num_buckets];
+    uint16_t *indices = (uint16_t *)&chain[num];
+
+    size_t n = 0;
+    for (size_t i = 0; i < elf_symbols_num; i++)
+    {
+        if (!elf_symbols[i].public)
+            continue;
+
+        uint32_t h = dsl_symbol_hash(elf_symbols[i].name);
+
+        entries[n].hash = h;
+        entries[n].bucket = h % num_buckets;
+        entries[n].index = i;
+        n++;
+
+        bloom[(h / 32) % bloom_size] |= (1u << (h % 32))
+                                      | (1u << ((h >> bloom_shift) % 32));
+    }
+
+    // Symbols of the same bucket must be consecutive in the chain
+    qsort(entries, num, sizeof(hash_entry), sym_compare_hash_entries);
+
+    for (uint32_t b = 0; b < num_buckets; b++)
+        buckets[b] = DSL_HASH_EMPTY_BUCKET;
+
+    for (size_t i = 0; i < num; i++)
+    {
+        bool last = (i + 1 == num) || (entries[i + 1].bucket != entries[i].bucket);
+
+        if (buckets[entries[i].bucket] == DSL_HASH_EMPTY_BUCKET)
+            buckets[entries[i].bucket] = i;
+
+        chain[i] = (entries[i].hash & ~1u) | (last ? 1 : 0);
+        indices[i] = entries[i].index;
+    }
+
+    free(entries);
+
+    VERBOSE("Symbol hash table: %zu symbols, %u buckets, %u bloom words\n",
+            num, num_buckets, bloom_size);
+
+    return table;
+}
+
 int sym_table_save_to_file(FILE *f, bool ignore_unresolved_symbols)
 {
+    if (elf_symbols_num > UINT16_MAX)
+    {
+        ERROR("Too many symbols: %zu (max %u)\n", elf_symbols_num, UINT16_MAX);
+        return -1;
+    }
+
     dsl_symbol_table header = {
         .num_symbols = elf_symbols_num,
         .unused = {0},
@@ -193,7 +371,7 @@ int sym_table_save_to_file(FILE *f, bool ignore_unresolved_symbols)
 
             sym.attributes |= DSL_SYMBOL_PUBLIC;
         }
-        else if (elf_symbols[i].unknown)
+        else if (sym_is_in_main_binary(i))
         {
             // If this symbol is unknown look for it in the main binary and edit
             // the symbol to define the address.
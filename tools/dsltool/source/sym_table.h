@@ -14,6 +14,8 @@ int sym_set_as_used(unsigned int index);
 int sym_set_as_public(unsigned int index);
 
 bool sym_is_unknown(unsigned int index);
+bool sym_is_in_main_binary(unsigned int index);
+uint32_t sym_get_value(unsigned int index);
 const char *sym_get_name(unsigned int index);
 int sym_get_index_from_name(const char *name);
 int sym_get_sym_index_by_old_index(unsigned int index);
@@ -24,4 +26,8 @@ void sym_clear_table(void);
 void sym_print_table(void);
 int sym_table_save_to_file(FILE *f, bool ignore_unresolved_symbols);
 
+// Returns a buffer allocated with malloc() with the data of a symbol hash
+// table for the current symbol table (see dsl_symbol_hash_table).
+void *sym_table_build_hash(size_t *size);
+
 #endif // SYM_TABLE_H__
@@ -0,0 +1,96 @@
+#!/usr/bin/env python3
+
+# SPDX-License-Identifier: CC0-1.0
+#
+# SPDX-FileContributor: Antonio Niño Díaz, 2026
+
+# Synthetic source trees to measure the build speed of mkfatimg and the layout
+# of the images it creates. The contents of the trees only depend on the seed,
+# so the same tree can be generated again to compare versions of the tool:
+#
+#     python3 scripts/gentree.py --profile mixed /tmp/tree
+#     ./mkfatimg -r -t /tmp/tree /tmp/tree.img 0 auto
+#
+# Profiles:
+#
+#     tiny:  Many small files (0 to 2 KiB) spread over a few directories.
+#     huge:  A few big files (the size is set with --huge-size).
+#     deep:  A chain of nested directories with long names and a few files at
+#            every level.
+#     mixed: All of the above, each one in its own directory.
+
+import argparse
+import os
+import random
+import sys
+
+
+def write_file(path, size, rng):
+    with open(path, 'wb') as f:
+        while size > 0:
+            chunk = min(size, 1024 * 1024)
+            f.write(rng.randbytes(chunk))
+            size -= chunk
+
+
+def gen_tiny(root, rng, scale):
+    files = 20000 * scale
+    dirs = 100
+    for d in range(dirs):
+        os.makedirs(os.path.join(root, f'dir{d:03}'), exist_ok=True)
+    for i in range(files):
+        path = os.path.join(root, f'dir{i % dirs:03}', f'file{i:06}.bin')
+        write_file(path, rng.randrange(0, 2049), rng)
+
+
+def gen_huge(root, rng, scale, huge_size):
+    os.makedirs(root, exist_ok=True)
+    for i in range(4 * scale):
+        # Sizes that aren't a multiple of any cluster size
+        size = huge_size - rng.randrange(0, 65536)
+        write_file(os.path.join(root, f'huge{i:02}.bin'), size, rng)
+
+
+def gen_deep(root, rng, scale):
+    path = root
+    for level in range(16):
+        path = os.path.join(path, f'deep level {level:02} dir')
+        os.makedirs(path, exist_ok=True)
+        for i in range(4 * scale):
+            name = f'file {i:02} at level {level:02}.dat'
+            write_file(os.path.join(path, name), rng.randrange(0, 65537), rng)
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Generate synthetic trees for mkfatimg.')
+    parser.add_argument('output', help='Directory to create (must not exist)')
+    parser.add_argument('--profile', default='mixed',
+                        choices=['tiny', 'huge', 'deep', 'mixed'])
+    parser.add_argument('--seed', type=int, default=1, help='Seed of the contents')
+    parser.add_argument('--scale', type=int, default=1, help='Multiplier of the number of files')
+    parser.add_argument('--huge-size', type=int, default=64 * 1024 * 1024,
+                        help='Approximate size of the files of the huge profile in bytes')
+    args = parser.parse_args()
+
+    if os.path.exists(args.output):
+        print(f'{args.output} already exists', file=sys.stderr)
+        return 1
+
+    rng = random.Random(args.seed)
+
+    if args.profile == 'tiny':
+        gen_tiny(args.output, rng, args.scale)
+    elif args.profile == 'huge':
+        gen_huge(args.output, rng, args.scale, args.huge_size)
+    elif args.profile == 'deep':
+        gen_deep(args.output, rng, args.scale)
+    else:
+        gen_tiny(os.path.join(args.output, 'tiny'), rng, args.scale)
+        gen_huge(os.path.join(args.output, 'huge'), rng, args.scale, args.huge_size)
+        gen_deep(os.path.join(args.output, 'deep'), rng, args.scale)
+
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -22,9 +22,13 @@
 /* RAM disk control module for Win32              (C)ChaN, 2014          */
 /*-----------------------------------------------------------------------*/
 
+#include <fcntl.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "ff.h"
 #include "diskio.h"
@@ -38,7 +42,9 @@
 
 
 extern BYTE *RamDisk;		/* Poiter to the active RAM disk (main.c) */
-extern DWORD RamDiskSize;	/* Size of RAM disk in unit of sector */
+extern size_t RamDiskSize;	/* Size of RAM disk in unit of sector */
+
+static int RamDiskFd = -1;	/* Output file mapped as RAM disk (-1: heap) */
 
 
 /*--------------------------------------------------------------------------
@@ -67,6 +73,72 @@ DSTATUS disk_initialize (
 
 
 
+/*-----------------------------------------------------------------------*/
+/* Map Output File as RAM Disk                                           */
+/*-----------------------------------------------------------------------*/
+/* The file is extended with ftruncate() so that it is sparse. Only the
+/  sectors that FatFs actually writes get allocated in the host filesystem,
+/  so the memory and I/O cost depends on the payload, not the volume size.
+*/
+
+int disk_map_file (	/* 1:OK, 0:Error */
+	const char *path,	/* Path to the output image file */
+	int create			/* 1:Create a new image, 0:Open an existing image */
+)
+{
+	struct stat st;
+	size_t size;
+	void *map;
+
+	if (RamDisk) return 0;
+
+	RamDiskFd = open(path, create ? O_RDWR | O_CREAT | O_TRUNC : O_RDWR, 0644);
+	if (RamDiskFd < 0) return 0;
+
+	if (!create) {	/* Take the size from the existing image */
+		if (fstat(RamDiskFd, &st) == 0) RamDiskSize = (size_t)st.st_size / FF_MIN_SS;
+		else RamDiskSize = 0;
+	}
+	size = RamDiskSize * FF_MIN_SS;
+
+	if (size && ftruncate(RamDiskFd, (off_t)size) == 0) {
+		map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, RamDiskFd, 0);
+		if (map != MAP_FAILED) {
+			RamDisk = map;
+			return 1;
+		}
+	}
+
+	close(RamDiskFd);
+	RamDiskFd = -1;
+	return 0;
+}
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Unmap Output File                                                     */
+/*-----------------------------------------------------------------------*/
+
+int disk_unmap_file (	/* 1:OK, 0:Error */
+	size_t nsect		/* Final size of the image in unit of sector */
+)
+{
+	int ok = 1;
+
+	if (RamDiskFd < 0) return 0;
+
+	if (munmap(RamDisk, RamDiskSize * FF_MIN_SS)) ok = 0;
+	RamDisk = NULL;
+	if (ftruncate(RamDiskFd, (off_t)nsect * FF_MIN_SS)) ok = 0;
+	if (close(RamDiskFd)) ok = 0;
+	RamDiskFd = -1;
+
+	return ok;
+}
+
+
+
 /*-----------------------------------------------------------------------*/
 /* Get Disk Status                                                       */
 /*-----------------------------------------------------------------------*/
@@ -89,12 +161,12 @@ DSTATUS disk_status (
 DRESULT disk_read (
 	BYTE pdrv,			/* Physical drive nmuber (0) */
 	BYTE *buff,			/* Pointer to the data buffer to store read data */
-	DWORD sector,		/* Start sector number (LBA) */
+	LBA_t sector,		/* Start sector number (LBA) */
 	UINT count			/* Number of sectors to read */
 )
 {
 	if (pdrv || !RamDisk) return RES_NOTRDY;
-	if (sector >= RamDiskSize) return RES_PARERR;
+	if (sector >= RamDiskSize || count > RamDiskSize - sector) return RES_PARERR;
 
 	memcpy(buff, RamDisk + sector * FF_MIN_SS, count * FF_MIN_SS);
 
@@ -110,12 +182,12 @@ DRESULT disk_read (
 DRESULT disk_write (
 	BYTE pdrv,			/* Physical drive nmuber (0) */
 	const BYTE *buff,	/* Pointer to the data to be written */
-	DWORD sector,		/* Start sector number (LBA) */
+	LBA_t sector,		/* Start sector number (LBA) */
 	UINT count			/* Number of sectors to write */
 )
 {
 	if (pdrv || !RamDisk) return RES_NOTRDY;
-	if (sector >= RamDiskSize) return RES_PARERR;
+	if (sector >= RamDiskSize || count > RamDiskSize - sector) return RES_PARERR;
 
 	memcpy(RamDisk + sector * FF_MIN_SS, buff, count * FF_MIN_SS);
 
@@ -145,7 +217,7 @@ DRESULT disk_ioctl (
 			break;
 
 		case GET_SECTOR_COUNT:
-			*(DWORD*)buff = RamDiskSize;
+			*(LBA_t*)buff = RamDiskSize;
 			dr = RES_OK;
 			break;
 
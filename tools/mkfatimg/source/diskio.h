@@ -21,6 +21,8 @@
 #ifndef _DISKIO_DEFINED
 #define _DISKIO_DEFINED
 
+#include <stddef.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -48,6 +50,10 @@ DRESULT disk_read (BYTE pdrv, BYTE* buff, LBA_t sector, UINT count);
 DRESULT disk_write (BYTE pdrv, const BYTE* buff, LBA_t sector, UINT count);
 DRESULT disk_ioctl (BYTE pdrv, BYTE cmd, void* buff);
 
+/* mkfatimg: use a memory-mapped output file as RAM disk */
+int disk_map_file (const char* path, int create);
+int disk_unmap_file (size_t nsect);
+
 
 /* Disk Status Bits (DSTATUS) */
 
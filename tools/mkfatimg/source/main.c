@@ -19,24 +19,40 @@
 /  FAT image creator R0.02               (C)ChaN, 2017
 /--------------------------------------------------------*/
 
+#ifdef __linux__
+#define _GNU_SOURCE	/* copy_file_range() */
+#endif
+
 #define DIR DIRff
 #include "ff.h"
 #undef DIR
 
 #include <dirent.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <linux/fs.h>	/* FICLONE */
+#include <sys/ioctl.h>
+#endif
 
 #include "diskio.h"
+#include "prefetch.h"
 
 
 #if FF_MIN_SS != FF_MAX_SS
 #error Sector size must be fixed at any value
 #endif
 
+#define MAX_FAT12	0xFF5	/* Maximum number of clusters for FAT12 (as in ff.c) */
+#define MAX_FAT16	0xFFF5	/* Maximum number of clusters for FAT16 (as in ff.c) */
+#define MAX_FAT32	0x0FFFFFF5	/* Maximum number of clusters for FAT32 (as in ff.c) */
 #define MIN_FAT16	4086U	/* Minimum number of clusters for FAT16 */
 #define	MIN_FAT32	65526U	/* Minimum number of clusters for FAT32 */
 
@@ -46,10 +62,16 @@
 #define BPB_FATSz16			22		/* FAT size [sector] (2) */
 #define BPB_TotSec32		32		/* Volume size [sector] (4) */
 #define BPB_FATSz32			36		/* FAT size [sector] (4) */
+#define BPB_FSInfo32		48		/* FAT32: FSInfo sector (2) */
+#define BPB_VolLengthEx		72		/* exFAT: Volume size [sector] (8) */
+#define FSI_Free_Count		488		/* FAT32 FSI: Number of free clusters (4) */
+
+#define FA_MODIFIED			0x40	/* File has been modified (as in ff.c) */
 
 /* External functions (ff.c) */
 extern DWORD get_fat (FFOBJID* obj, DWORD);		/* Read an FAT item */
 extern DWORD ld_dword (const BYTE* ptr);		/* Load a 4-byte little-endian word */
+extern QWORD ld_qword (const BYTE* ptr);		/* Load an 8-byte little-endian word */
 extern WORD ld_word (const BYTE* ptr);			/* Load a 2-byte little-endian word */
 extern void st_word (BYTE* ptr, WORD val);		/* Store a 2-byte word in little-endian */
 extern void st_dword (BYTE* ptr, DWORD val);	/* Store a 4-byte word in little-endian */
@@ -58,23 +80,138 @@ extern void st_dword (BYTE* ptr, DWORD val);	/* Store a 4-byte word in little-en
 uint8_t *RamDisk;	/* Poiter to the RAM disk */
 size_t RamDiskSize;	/* Size of RAM disk in unit of sector */
 
+typedef struct {
+	char *src;			/* Path of the source file or directory */
+	const char *dst;	/* Path in the FAT volume (suffix of src) */
+	FSIZE_t size;		/* Size of the file */
+	time_t mtime;		/* Modification time of the file */
+	int isdir;			/* 1: Directory, 0: File */
+	int placed;			/* Already added to the placement order */
+	PFJOB *job;			/* Prefetch job of the file */
+	DWORD sclust;		/* First cluster of the file in the volume */
+	uint64_t hash;		/* Hash of the contents (valid if hashed is 1) */
+	int hashed;
+	long dupnext;		/* Next file in the same bucket of DupHash (-1: none) */
+} ENTRY;
+
 static int verbose = 0;
+static int contiguous = 0;
+static const char *Layout = NULL;	/* Layout manifest (NULL: directory order) */
+static int update = 0;		/* Update an existing image instead of creating one */
+static int exfat = 0;		/* Create an exFAT volume instead of FAT12/16/32 */
+static int dedupe = 0;		/* Share clusters between identical files */
+static int extindex = 0;	/* Write an extent index of all files (INDEX_NAME) */
+static int report = 0;		/* Print build time and layout statistics */
+static unsigned int Threads;	/* Number of threads that read source files */
 
 static FATFS FatFs;
 static FIL DstFile;
 static FILE *SrcFile;
 static char SrcPath[512], DstPath[512];
 static uint8_t Buff[4096];
-static unsigned int Dirs, Files;
+static unsigned int Dirs, Files, Unchanged, Removed, Linked;
+static size_t LinkedSize;
 static size_t TotalFilesSize;
+static size_t SizeHist[64][2];	/* Number of files and bytes by log2 of the size */
+
+static ENTRY *Tree;			/* Source tree in directory order, parents first */
+static size_t TreeLen, TreeMax;
+static size_t *Order;		/* Indices of Tree in the order they are placed */
+static size_t OrderLen;
+static PFJOB *Jobs;			/* Source files to be read, in placement order */
+static size_t NJobs;
+static long *DupHash;		/* Files written to the volume, hashed by size */
+static size_t DupHashSize;	/* Number of buckets (power of two) */
+static DWORD *Clmt;			/* Cluster runs of a file (see getruns()) */
+static DWORD ClmtLen;		/* Size of Clmt in items */
+
+static double ScanTime, BuildTime;	/* Duration of the build steps in seconds */
+static size_t RunHist[9];	/* Number of files by number of runs (8: 8 or more) */
+static size_t ContigBytes;	/* Size of the files stored in a single run */
+static size_t LongestChain;	/* Clusters of the longest cluster chain */
+static const char *LongestPath;
+
+#define PREFETCH_BUDGET	(64 * 1024 * 1024)	/* Max. bytes read ahead of the writer */
+
+/* Extent index. The file is stored in the root directory with the hidden and
+ * system attributes. All fields are little-endian.
+ *
+ * Header (16 bytes):
+ *   0: "FIDX"
+ *   4: Version (2), currently 1
+ *   6: Sector size in bytes (2)
+ *   8: Number of files (4)
+ *  12: Cluster size in sectors (4)
+ * Offset table: one offset (4) per file, from the start of the index, in the
+ * order of the records.
+ * Records, sorted by path (as strcmp()), each one aligned to 4 bytes:
+ *   0: Number of runs (4)
+ *   4: Length of the path in bytes, without terminator (4)
+ *   8: Size of the file in bytes (8)
+ *  16: Runs: first sector from the start of the volume (4), length in
+ *      sectors (4). The sectors of the last cluster past the end of the file
+ *      are included.
+ *   *: Path in the volume ("/dir/file", UTF-8), terminated by a zero */
+#define INDEX_NAME		"/EXTENTS.IDX"
+#define INDEX_VERSION	1
+#define INDEX_HDR		16
+#define INDEX_REC		16	/* Size of a record without runs and path */
+
+/* Add the node at SrcPath to the source tree */
+static int addentry (const struct stat *st, size_t rootlen)
+{
+	ENTRY *e;
+
+	if (TreeLen == TreeMax) {
+		TreeMax = TreeMax ? TreeMax * 2 : 256;
+		e = realloc(Tree, TreeMax * sizeof(ENTRY));
+		if (e == NULL) {
+			printf("Out of memory.\n");
+			return 0;
+		}
+		Tree = e;
+	}
+
+	e = &Tree[TreeLen];
+	e->src = strdup(SrcPath);
+	if (e->src == NULL) {
+		printf("Out of memory.\n");
+		return 0;
+	}
+	e->dst = e->src + rootlen;
+	e->size = S_ISDIR(st->st_mode) ? 0 : (FSIZE_t)st->st_size;
+	e->mtime = st->st_mtime;
+	e->isdir = S_ISDIR(st->st_mode) != 0;
+	e->placed = 0;
+	e->job = NULL;
+	e->sclust = 0;
+	e->hashed = 0;
+	e->dupnext = -1;
+	TreeLen++;
 
-int treesize(void)
+	return 1;
+}
+
+/* Histogram bucket of a file size: 0 for empty files, n for sizes in the
+ * range [2^(n-1), 2^n) */
+static int sizeclass (size_t size)
+{
+	int n = 0;
+
+	while (size) {
+		size >>= 1;
+		n++;
+	}
+	return n;
+}
+
+/* Scan the source tree at SrcPath and add all its nodes to Tree */
+int treesize(size_t rootlen)
 {
 	DIR *pdir;
-	int slen, dlen, rv = 0;
+	int slen, rv = 0;
 
 	slen = strlen(SrcPath);
-	dlen = strlen(DstPath);
 
 	pdir = opendir(SrcPath);		/* Open directory */
 	if (pdir == NULL) {
@@ -87,96 +224,1054 @@ int treesize(void)
 
 	while ((pent = readdir(pdir)) != NULL)
 	{
-		sprintf(&SrcPath[slen], "/%s", pent->d_name);
-		sprintf(&DstPath[dlen], "/%s", pent->d_name);
+		if (snprintf(&SrcPath[slen], sizeof SrcPath - slen, "/%s", pent->d_name) >= (int)(sizeof SrcPath - slen)) {
+			printf("Path too long: %s\n", SrcPath); break;
+		}
 
-		stat(SrcPath, &statbuf);
+		if (stat(SrcPath, &statbuf)) {
+			printf("Failed to get information of %s.\n", SrcPath); break;
+		}
 
 		if (S_ISDIR(statbuf.st_mode)) {	/* The item is a directory */
 			if (strcmp(pent->d_name, ".") && strcmp(pent->d_name, "..")) {
 				if (verbose)
 					printf("Dir:  %s\n", SrcPath);
-				if (!treesize()) break;	/* Enter the directory */
+				if (!addentry(&statbuf, rootlen)) break;
+				if (!treesize(rootlen)) break;	/* Enter the directory */
 			}
 		} else {	/* The item is a file */
 			if (verbose)
 				printf("File: %s (%zu bytes)\n", SrcPath, (size_t)statbuf.st_size);
+			if (!addentry(&statbuf, rootlen)) break;
 			TotalFilesSize += statbuf.st_size;
+			SizeHist[sizeclass((size_t)statbuf.st_size)][0]++;
+			SizeHist[sizeclass((size_t)statbuf.st_size)][1] += statbuf.st_size;
 		}
 	}
 	closedir(pdir);
-	rv = 1;
+	rv = (pent == NULL);	/* Not all entries processed if there was an error */
 
 end:
 	SrcPath[slen] = 0;
-	DstPath[dlen] = 0;
 	return rv;
 }
 
-int maketree (void)
+/* Space used by all files of the source tree with a cluster size */
+static size_t clustered (size_t csz)
+{
+	size_t i, total = 0;
+
+	if (csz == 0) return TotalFilesSize;
+	for (i = 0; i < TreeLen; i++) {
+		if (!Tree[i].isdir) total += ((size_t)Tree[i].size + csz - 1) / csz * csz;
+	}
+	return total;
+}
+
+#define READ_COST	2048	/* Cost of one more cluster read in bytes of slack */
+
+/* Select the cluster size for the source tree. Big clusters waste space at the
+ * end of small files, small clusters mean that big files need more (smaller)
+ * reads and a bigger FAT. The cost of each cluster size is the slack space
+ * plus the size of the FAT plus a fixed cost per cluster read. Cluster sizes
+ * that create too many clusters for the FAT type are discarded. With -t the
+ * volume only has the clusters used by the files. */
+static unsigned int tunecluster (int truncation)
+{
+	unsigned int c, best = 0, maxc = exfat ? 262144 : 65536;
+	size_t i, ndirs = 0, reads, slack, fatsz, used, nvol, cost, bestcost = 0;
+	int t;
+
+	for (i = 0; i < TreeLen; i++) ndirs += Tree[i].isdir;
+
+	printf("File size histogram:\n");
+	for (t = 0; t < 64; t++) {
+		if (SizeHist[t][0])
+			printf("    < %10zu bytes: %8zu files, %12zu bytes\n", (size_t)1 << t, SizeHist[t][0], SizeHist[t][1]);
+	}
+
+	if (verbose)
+		printf("Cluster size     slack   clusters   FAT size      cost\n");
+	for (c = 512; c <= maxc; c *= 2) {
+		slack = clustered(c) - TotalFilesSize;
+		reads = clustered(c) / c;
+		used = reads + ndirs + 1;	/* At least one cluster per directory */
+		nvol = RamDiskSize ? RamDiskSize * FF_MIN_SS / c : used * 140 / 100;
+		if (exfat) {
+			fatsz = nvol * 4 + nvol / 8;	/* FAT and allocation bitmap */
+		} else {
+			if (nvol > MAX_FAT32) continue;	/* Too many clusters for FAT32 */
+			if (truncation) nvol = used;	/* The volume is planned to fit the files */
+			t = nvol <= MAX_FAT12 ? 12 : nvol <= MAX_FAT16 ? 16 : 32;
+			fatsz = t == 12 ? nvol * 3 / 2 : nvol * (t / 8);
+		}
+		cost = slack + fatsz + reads * READ_COST;
+		if (verbose)
+			printf("%12u %9zu %10zu %10zu %9zu\n", c, slack, reads, fatsz, cost);
+		if (best == 0 || cost < bestcost) {
+			best = c;
+			bestcost = cost;
+		}
+	}
+
+	if (best == 0) {
+		printf("No valid cluster size found. Adjust volume size.\n");
+		return 0;
+	}
+	printf("Selected cluster size: %u bytes (%zu KiB of slack, %zu cluster reads)\n",
+			best, (clustered(best) - TotalFilesSize) / 1024, clustered(best) / best);
+	return best;
+}
+
+/* Number of LFN entries that FatFs may need for a name. This is an upper
+ * bound: names that aren't plain 8.3 names with the same case in the body
+ * and in the extension are considered to need a LFN. */
+static unsigned int lfnentries (const char *name)
+{
+	const char *dot = strrchr(name, '.');
+	const char *p;
+	size_t len, ext;
+	unsigned int units = 0;
+	int lower, upper;
+
+	len = strlen(name);
+	ext = dot ? len - (size_t)(dot - name) - 1 : 0;
+	if (len && dot != name && (dot ? (size_t)(dot - name) : len) <= 8 && ext <= 3 && (!dot || ext)) {
+		lower = upper = 0;
+		for (p = name; *p; p++) {
+			if (p == dot) {	/* The case of the extension is checked separately */
+				if (lower && upper) break;
+				lower = upper = 0;
+			} else if (*p >= 'a' && *p <= 'z') {
+				lower = 1;
+			} else if (*p >= 'A' && *p <= 'Z') {
+				upper = 1;
+			} else if (!((*p >= '0' && *p <= '9') || strchr("!#$%&'()-@^_`{}~", *p))) {
+				break;
+			}
+		}
+		if (*p == 0 && !(lower && upper)) return 0;
+	}
+
+	for (p = name; *p; p++) {	/* Length in UTF-16 units */
+		if ((*p & 0xC0) != 0x80) units += ((*p & 0xF8) == 0xF0) ? 2 : 1;
+	}
+	return (units + 12) / 13;
+}
+
+/* Size of the extent index if every file that isn't empty has nruns runs */
+static size_t indexsize (size_t nruns)
+{
+	size_t i, sz = INDEX_HDR;
+
+	for (i = 0; i < TreeLen; i++) {
+		if (Tree[i].isdir) continue;
+		sz += 4 + INDEX_REC + (Tree[i].size ? nruns * 8 : 0);
+		sz += (strlen(Tree[i].dst) + 1 + 3) & ~(size_t)3;
+	}
+	return sz;
+}
+
+/* Calculate the number of clusters used by the source tree, and the number of
+ * entries of the root directory. The result may be slightly bigger than what
+ * is actually needed. */
+static size_t plancount (unsigned int csz, size_t *rootents)
+{
+	size_t *ents, *stack, depth = 0, i, ncl = 0;
+	const char *name;
+
+	ents = calloc(TreeLen + 1, sizeof(size_t));	/* Entries of each directory */
+	stack = malloc((TreeLen + 1) * sizeof(size_t));	/* Ancestors of the current entry */
+	if (ents == NULL || stack == NULL) {
+		free(ents);
+		free(stack);
+		return 0;
+	}
+
+	for (i = 0; i < TreeLen; i++) {
+		/* Tree is in directory order, so the parent is in the stack */
+		while (depth && !(strncmp(Tree[i].dst, Tree[stack[depth - 1]].dst, strlen(Tree[stack[depth - 1]].dst)) == 0 &&
+				Tree[i].dst[strlen(Tree[stack[depth - 1]].dst)] == '/'))
+			depth--;
+		name = strrchr(Tree[i].dst, '/') + 1;
+		ents[depth ? stack[depth - 1] + 1 : 0] += 1 + lfnentries(name);
+		if (Tree[i].isdir) {
+			ents[i + 1] = 2;	/* Dot entries */
+			stack[depth++] = i;
+		} else {
+			ncl += ((size_t)Tree[i].size + csz - 1) / csz;
+		}
+	}
+	for (i = 0; i < TreeLen; i++) {
+		if (Tree[i].isdir) ncl += (ents[i + 1] * 32 + csz - 1) / csz;
+	}
+	if (extindex) {	/* Files are written in a single run each */
+		ents[0]++;
+		ncl += (indexsize(1) + csz - 1) / csz;
+	}
+	ncl += (ents[0] * 32 + csz - 1) / csz;	/* The FAT32 root directory uses clusters */
+
+	*rootents = ents[0];
+	free(ents);
+	free(stack);
+	return ncl;
+}
+
+/* Number of clusters and FAT type that f_mkfs() creates in a volume of
+ * sz_vol sectors with one FAT and no alignment. This follows the calculations
+ * of f_mkfs(). Returns 0 if f_mkfs() would fail. */
+static size_t mkfsclusters (size_t sz_vol, size_t pau, size_t n_root, int *fsty)
+{
+	size_t n_clst, n, sz_fat, sz_rsv, sz_dir;
+
+	if (sz_vol < 128 || sz_vol > 0xFFFFFFFF) return 0;
+
+	*fsty = FS_FAT16;
+	for (;;) {
+		n_clst = sz_vol / pau;
+		if (*fsty == FS_FAT32) {
+			sz_fat = (n_clst * 4 + 8 + FF_MIN_SS - 1) / FF_MIN_SS;
+			sz_rsv = 32;
+			sz_dir = 0;
+			if (n_clst <= MAX_FAT16 || n_clst > MAX_FAT32) return 0;
+		} else {
+			if (n_clst > MAX_FAT12) {
+				n = n_clst * 2 + 4;
+			} else {
+				*fsty = FS_FAT12;
+				n = (n_clst * 3 + 1) / 2 + 3;
+			}
+			sz_fat = (n + FF_MIN_SS - 1) / FF_MIN_SS;
+			sz_rsv = 1;
+			sz_dir = n_root * 32 / FF_MIN_SS;
+		}
+		if (sz_vol < sz_rsv + sz_fat + sz_dir + pau * 16) return 0;
+		n_clst = (sz_vol - sz_rsv - sz_fat - sz_dir) / pau;
+		if (*fsty == FS_FAT32 && n_clst <= MAX_FAT16) return 0;
+		if (*fsty == FS_FAT16) {
+			if (n_clst > MAX_FAT16) {
+				*fsty = FS_FAT32;
+				continue;
+			}
+			if (n_clst <= MAX_FAT12) return 0;
+		}
+		if (*fsty == FS_FAT12 && n_clst > MAX_FAT12) return 0;
+		return n_clst;
+	}
+}
+
+/* Plan the layout of a read-only volume: size the root directory for the
+ * entries it needs and find the smallest volume with enough clusters for the
+ * source tree. Returns the size of the volume in sectors, or 0 on error. */
+static size_t planvolume (unsigned int csz, UINT *n_root)
+{
+	size_t need, rootents, sz_vol, n_clst, pau = csz / FF_MIN_SS;
+	int fsty;
+
+	need = plancount(csz, &rootents);
+	if (need == 0) return 0;
+	rootents = (rootents + (FF_MIN_SS / 32 - 1)) / (FF_MIN_SS / 32) * (FF_MIN_SS / 32);
+	if (rootents > 32768) rootents = 32768;	/* Only FAT32 is possible */
+	*n_root = (UINT)rootents;
+
+	sz_vol = need * pau;
+	for (;;) {
+		n_clst = mkfsclusters(sz_vol, pau, rootents, &fsty);
+		if (n_clst >= need) break;
+		if (sz_vol > 0xFFFFFFFF) return 0;
+		/* Grow the volume by the missing clusters, or by a bit more if the
+		 * size is invalid (e.g. too few clusters for the FAT type). */
+		sz_vol += (n_clst ? need - n_clst : need / 64 + 1) * pau;
+	}
+
+	printf("Planned volume: %zu clusters used by files and directories, %zu root entries.\n", need, rootents);
+	return sz_vol;
+}
+
+/* Convert a host timestamp to the FAT date (upper 16 bits) and time */
+static DWORD fattime (time_t t)
+{
+	struct tm *stm = localtime(&t);
+
+	if (stm == NULL || stm->tm_year < 80) return (DWORD)1 << 21 | (DWORD)1 << 16;	/* 1980-01-01 */
+
+	return (DWORD)(stm->tm_year - 80) << 25 |
+		   (DWORD)(stm->tm_mon + 1) << 21 |
+		   (DWORD)stm->tm_mday << 16 |
+		   (DWORD)stm->tm_hour << 11 |
+		   (DWORD)stm->tm_min << 5 |
+		   (DWORD)stm->tm_sec >> 1;
+}
+
+/* Set the timestamp of a file in the volume to the modification time of the
+ * source file */
+static int copytime (const ENTRY *e)
+{
+	FILINFO fno;
+	DWORD tm = fattime(e->mtime);
+
+	fno.fdate = (WORD)(tm >> 16);
+	fno.ftime = (WORD)tm;
+	return f_utime(e->dst, &fno) == FR_OK;
+}
+
+/* Copy a source file to the FAT volume. The contents are taken from the
+ * prefetcher if it has read them. Otherwise, the file is read here. */
+int copyfile (ENTRY *e, const uint8_t *data)
 {
-	DIR *pdir;
-	int slen, dlen, rv = 0;
 	DWORD br;
 	UINT bw;
 
+	if (verbose)
+		printf("Adding:   %s\n", e->dst);
+	if (data == NULL && (SrcFile = fopen(e->src, "rb")) == NULL) {	/* Open source file */
+		printf("Failed to open source file.\n"); return 0;
+	}
+	if (f_open(&DstFile, e->dst, FA_CREATE_ALWAYS | FA_WRITE)) {	/* Create destination file */
+		if (data == NULL) fclose(SrcFile);
+		printf("Failed to create destination file.\n"); return 0;
+	}
+	if (contiguous && e->size > 0 && f_expand(&DstFile, e->size, 1)) {	/* Allocate all clusters as one block */
+		if (data == NULL) fclose(SrcFile);
+		f_close(&DstFile);
+		printf("Failed to allocate contiguous area for file. Adjust volume size.\n"); return 0;
+	}
+	if (data != NULL) {	/* Write the whole file at once */
+		br = (DWORD)e->size;
+		bw = 0;
+		if (br) f_write(&DstFile, data, (UINT)br, &bw);
+	} else {
+		do {	/* Copy source file to destination file */
+			br = fread(Buff, 1, sizeof(Buff), SrcFile);
+			if (br == 0) break;
+			f_write(&DstFile, Buff, (UINT)br, &bw);
+		} while (br == bw);
+		fclose(SrcFile);
+	}
+	e->sclust = DstFile.obj.sclust;
+	f_close(&DstFile);
+	if (br && br != bw) {
+		printf("Failed to write file.\n"); return 0;
+	}
+	if (!copytime(e)) {
+		printf("Failed to set timestamp of file.\n"); return 0;
+	}
+	Files++;
+	return 1;
+}
+
+/* Hash the contents of a source file (64-bit FNV-1a) */
+static int hashfile (ENTRY *e, const uint8_t *data)
+{
+	uint64_t h = 0xCBF29CE484222325ULL;
+	size_t i, n = 0;
+	FILE *fp = NULL;
+
+	if (e->hashed) return 1;
+
+	if (data == NULL && (fp = fopen(e->src, "rb")) == NULL) return 0;
+	do {
+		if (fp != NULL) {
+			n = fread(Buff, 1, sizeof(Buff), fp);
+			data = Buff;
+		} else {
+			n = (size_t)e->size;
+		}
+		for (i = 0; i < n; i++) h = (h ^ data[i]) * 0x100000001B3ULL;
+	} while (fp != NULL && n == sizeof(Buff));
+	if (fp != NULL) fclose(fp);
+
+	e->hash = h;
+	e->hashed = 1;
+	return 1;
+}
+
+/* Check if the contents of two source files are the same. The contents of
+ * the second one may be available in memory already. */
+static int samesource (const ENTRY *a, const ENTRY *b, const uint8_t *bdata)
+{
+	static uint8_t Buff2[sizeof Buff];
+	FILE *fa, *fb = NULL;
+	size_t n, ofs = 0;
+	int same = 1;
+
+	if ((fa = fopen(a->src, "rb")) == NULL) return 0;
+	if (bdata == NULL && (fb = fopen(b->src, "rb")) == NULL) {
+		fclose(fa);
+		return 0;
+	}
+	do {
+		n = fread(Buff, 1, sizeof(Buff), fa);
+		if (fb != NULL) {
+			if (fread(Buff2, 1, sizeof(Buff2), fb) != n || memcmp(Buff, Buff2, n)) same = 0;
+		} else {
+			if (ofs + n > (size_t)b->size || memcmp(Buff, bdata + ofs, n)) same = 0;
+			ofs += n;
+		}
+	} while (same && n == sizeof(Buff));
+	fclose(fa);
+	if (fb != NULL) fclose(fb);
+	return same;
+}
+
+/* Copy a source file to the volume unless an identical file has been copied
+ * already. In that case, the new directory entry points to the clusters of
+ * the other file. This is only possible in read-only volumes. */
+static int dedupfile (ENTRY *e, const uint8_t *data)
+{
+	size_t bucket, i;
+	long j;
+	ENTRY *o;
+
+	if (e->size == 0) return copyfile(e, data);
+
+	bucket = (size_t)e->size & (DupHashSize - 1);
+	for (j = DupHash[bucket]; j >= 0; j = o->dupnext) {
+		o = &Tree[j];
+		if (o->size != e->size) continue;
+		if (!hashfile(o, NULL) || !hashfile(e, data)) break;
+		if (o->hash != e->hash || !samesource(o, e, data)) continue;
+
+		if (verbose)
+			printf("Linking:  %s -> %s\n", e->dst, o->dst);
+		if (f_open(&DstFile, e->dst, FA_CREATE_ALWAYS | FA_WRITE)) {
+			printf("Failed to create destination file.\n"); return 0;
+		}
+		DstFile.obj.sclust = o->sclust;	/* Written to the directory entry by f_close() */
+		DstFile.obj.objsize = o->size;
+		DstFile.flag |= FA_MODIFIED;
+		if (f_close(&DstFile) || !copytime(e)) {
+			printf("Failed to write file.\n"); return 0;
+		}
+		e->sclust = o->sclust;
+		Files++;
+		Linked++;
+		LinkedSize += (size_t)e->size;
+		return 1;
+	}
+
+	if (!copyfile(e, data)) return 0;
+	i = (size_t)(e - Tree);
+	e->dupnext = DupHash[bucket];
+	DupHash[bucket] = (long)i;
+	return 1;
+}
+
+/* Check if the contents of a source file and the file in the volume are the
+ * same. The source file is read here if the prefetcher hasn't read it. */
+static int samefile (const ENTRY *e, const uint8_t *data)
+{
+	static uint8_t Buff2[sizeof Buff];
+	FIL fil;
+	DWORD br;
+	UINT br2;
+	FSIZE_t ofs = 0;
+	int same = 1;
+
+	if (data == NULL && (SrcFile = fopen(e->src, "rb")) == NULL) return 0;
+	if (f_open(&fil, e->dst, FA_READ)) {
+		if (data == NULL) fclose(SrcFile);
+		return 0;
+	}
+	do {
+		if (data != NULL) {
+			br = (e->size - ofs < sizeof(Buff)) ? (DWORD)(e->size - ofs) : sizeof(Buff);
+			memcpy(Buff, data + ofs, br);
+			ofs += br;
+		} else {
+			br = fread(Buff, 1, sizeof(Buff), SrcFile);
+		}
+		if (f_read(&fil, Buff2, sizeof(Buff2), &br2) || br != br2 || memcmp(Buff, Buff2, br)) {
+			same = 0; break;
+		}
+	} while (br == sizeof(Buff));
+	if (data == NULL) fclose(SrcFile);
+	f_close(&fil);
+	return same;
+}
+
+/* Check if a file in the volume has the same size and timestamp as the
+ * source file (update mode) */
+static int uptodate (const ENTRY *e)
+{
+	FILINFO fno;
+	DWORD tm = fattime(e->mtime);
+
+	return f_stat(e->dst, &fno) == FR_OK && fno.fsize == e->size &&
+		   fno.fdate == (WORD)(tm >> 16) && fno.ftime == (WORD)tm;
+}
+
+/* Bring a file in the volume up to date with the source file (update mode).
+ * Files with the same size and timestamp have been removed from the placement
+ * order already. If only the timestamp is different, the contents are
+ * compared before rewriting it. */
+static int updatefile (ENTRY *e, const uint8_t *data)
+{
+	FILINFO fno;
+
+	if (f_stat(e->dst, &fno) == FR_OK) {
+		if (fno.fsize == e->size && samefile(e, data)) {
+			Unchanged++;
+			return copytime(e);
+		}
+		if (verbose)
+			printf("Removing: %s\n", e->dst);
+		if (f_unlink(e->dst)) {
+			printf("Failed to remove outdated file.\n"); return 0;
+		}
+	}
+	return copyfile(e, data);
+}
+
+/* Remove DstPath from the FAT volume, with all its contents if it's a
+ * directory */
+static int removetree (int isdir)
+{
+	DIRff dir;
+	FILINFO fno;
+	int dlen, rv = 1;
+
+	if (verbose)
+		printf("Removing: %s\n", DstPath);
+
+	if (isdir) {
+		dlen = strlen(DstPath);
+		if (f_opendir(&dir, DstPath)) return 0;
+		while (rv && f_readdir(&dir, &fno) == FR_OK && fno.fname[0]) {
+			snprintf(&DstPath[dlen], sizeof DstPath - dlen, "/%s", fno.fname);
+			rv = removetree(fno.fattrib & AM_DIR);
+		}
+		f_closedir(&dir);
+		DstPath[dlen] = 0;
+		if (!rv) return 0;
+	}
+
+	if (f_unlink(DstPath)) return 0;
+	Removed++;
+	return 1;
+}
+
+/* Remove all entries of the FAT volume under DstPath that don't exist in
+ * the source tree under SrcPath, or that have changed from directory to file
+ * or the other way around (update mode). */
+static int prunetree (void)
+{
+	DIRff dir;
+	FILINFO fno;
+	struct stat statbuf;
+	int slen, dlen, isdir, rv = 1;
+
 	slen = strlen(SrcPath);
 	dlen = strlen(DstPath);
 
-	pdir = opendir(SrcPath);		/* Open directory */
-	if (pdir == NULL) {
-		printf("Failed to open the source directory.\n");
-		goto end;
+	if (f_opendir(&dir, DstPath)) return 0;
+	while (rv && f_readdir(&dir, &fno) == FR_OK && fno.fname[0]) {
+		snprintf(&SrcPath[slen], sizeof SrcPath - slen, "/%s", fno.fname);
+		snprintf(&DstPath[dlen], sizeof DstPath - dlen, "/%s", fno.fname);
+
+		if (!strcmp(DstPath, INDEX_NAME) && (fno.fattrib & AM_SYS)) {
+			rv = f_unlink(DstPath) == FR_OK;	/* Written again at the end if needed */
+			continue;
+		}
+
+		isdir = (fno.fattrib & AM_DIR) != 0;
+		if (stat(SrcPath, &statbuf) || isdir != !!S_ISDIR(statbuf.st_mode)) {
+			rv = removetree(isdir);	/* Not in the source tree anymore */
+			if (!rv) printf("Failed to remove %s.\n", DstPath);
+		} else if (isdir) {
+			rv = prunetree();
+		}
 	}
+	f_closedir(&dir);
 
-	struct dirent *pent;
-	struct stat statbuf;
+	SrcPath[slen] = 0;
+	DstPath[dlen] = 0;
+	return rv;
+}
 
-	while ((pent = readdir(pdir)) != NULL)
-	{
-		sprintf(&SrcPath[slen], "/%s", pent->d_name);
-		sprintf(&DstPath[dlen], "/%s", pent->d_name);
+/* Add an entry of the source tree to the placement order */
+static void place (size_t i)
+{
+	if (Tree[i].placed) return;
+	Tree[i].placed = 1;
+	if (!Tree[i].isdir && update && uptodate(&Tree[i])) {
+		Unchanged++;	/* Don't even read it */
+		return;
+	}
+	Order[OrderLen++] = i;
+}
 
-		stat(SrcPath, &statbuf);
+static int cmpentry (const void *a, const void *b)
+{
+	return strcmp(Tree[*(const size_t *)a].dst, Tree[*(const size_t *)b].dst);
+}
 
-		if (S_ISDIR(statbuf.st_mode)) {	/* The item is a directory */
-			if (strcmp(pent->d_name, ".") && strcmp(pent->d_name, "..")) {
+/* Find an entry of the source tree by its path in the volume. ByPath is an
+ * index of Tree sorted by path. */
+static long findentry (const size_t *ByPath, const char *dst)
+{
+	size_t lo = 0, hi = TreeLen, mid;
+	int c;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		c = strcmp(Tree[ByPath[mid]].dst, dst);
+		if (c == 0) return (long)ByPath[mid];
+		if (c < 0) lo = mid + 1; else hi = mid;
+	}
+	return -1;
+}
+
+/* Place the files listed in the layout manifest in the order of the list.
+ * Each line is a path relative to the source node. Empty lines and lines
+ * that start with '#' are ignored. If a line is a directory, the whole
+ * directory is placed at that point. */
+int placelisted (void)
+{
+	FILE *fp;
+	char line[512];
+	char *name;
+	size_t len, i, dlen, *ByPath;
+	long idx;
+
+	fp = fopen(Layout, "r");
+	if (fp == NULL) {
+		printf("Failed to open layout manifest.\n");
+		return 0;
+	}
+
+	ByPath = malloc((TreeLen ? TreeLen : 1) * sizeof(size_t));
+	if (ByPath == NULL) {
+		fclose(fp);
+		printf("Out of memory.\n");
+		return 0;
+	}
+	for (i = 0; i < TreeLen; i++) ByPath[i] = i;
+	qsort(ByPath, TreeLen, sizeof(size_t), cmpentry);
+
+	while (fgets(line, sizeof line, fp)) {
+		len = strlen(line);
+		while (len && (line[len - 1] == '\n' || line[len - 1] == '\r' || line[len - 1] == ' ' || line[len - 1] == '\t'))
+			line[--len] = 0;
+		for (name = line; *name == ' ' || *name == '\t'; name++) ;
+		if (*name == 0 || *name == '#') continue;
+		if (name[0] == '.' && name[1] == '/') name += 2;
+		while (*name == '/') name++;
+
+		snprintf(DstPath, sizeof DstPath, "/%s", name);
+		idx = findentry(ByPath, DstPath);
+		if (idx < 0) {
+			printf("Warning: %s in layout manifest not found.\n", name);
+			continue;
+		}
+		i = (size_t)idx;
+		if (Tree[i].isdir) {	/* The contents of a directory follow it in Tree */
+			dlen = strlen(DstPath);
+			for (i++; i < TreeLen && !strncmp(Tree[i].dst, DstPath, dlen) && Tree[i].dst[dlen] == '/'; i++) {
+				if (!Tree[i].isdir) place(i);
+			}
+		} else {
+			place(i);
+		}
+	}
+
+	free(ByPath);
+	fclose(fp);
+	return 1;
+}
+
+/* Decide the order in which the source tree is placed in the volume */
+int makeorder (void)
+{
+	size_t i;
+
+	Order = malloc((TreeLen ? TreeLen : 1) * sizeof(size_t));
+	if (Order == NULL) {
+		printf("Out of memory.\n");
+		return 0;
+	}
+	OrderLen = 0;
+
+	if (Layout) {
+		/* Create all directories first so that their clusters don't end up
+		 * between the files that are listed together in the manifest. Then
+		 * place the listed files, and the rest of the tree after them. */
+		for (i = 0; i < TreeLen; i++) {
+			if (Tree[i].isdir) place(i);
+		}
+		if (!placelisted()) return 0;
+	}
+	for (i = 0; i < TreeLen; i++) place(i);
+
+	return 1;
+}
+
+/* Start reading the files in the placement order in the background */
+int startprefetch (void)
+{
+	size_t i;
+	ENTRY *e;
+
+	Jobs = malloc((OrderLen ? OrderLen : 1) * sizeof(PFJOB));
+	if (Jobs == NULL) {
+		printf("Out of memory.\n");
+		return 0;
+	}
+	NJobs = 0;
+
+	for (i = 0; i < OrderLen; i++) {
+		e = &Tree[Order[i]];
+		if (e->isdir) continue;
+		e->job = &Jobs[NJobs++];
+		e->job->path = e->src;
+		e->job->size = (size_t)e->size;
+	}
+
+	if (!pf_start(Jobs, NJobs, Threads, PREFETCH_BUDGET)) {
+		printf("Failed to start reader threads.\n");
+		return 0;
+	}
+	return 1;
+}
+
+/* Copy the source tree into the FAT volume in the placement order */
+int maketree (void)
+{
+	size_t i;
+	ENTRY *e;
+	FRESULT res;
+	const uint8_t *data;
+	int rv = 1;
+
+	if (!startprefetch()) return 0;
+
+	if (dedupe) {
+		for (DupHashSize = 1; DupHashSize < TreeLen; DupHashSize *= 2) ;
+		DupHash = malloc(DupHashSize * sizeof(long));
+		if (DupHash == NULL) {
+			pf_stop();
+			printf("Out of memory.\n");
+			return 0;
+		}
+		for (i = 0; i < DupHashSize; i++) DupHash[i] = -1;
+	}
+
+	for (i = 0; rv && i < OrderLen; i++) {
+		e = &Tree[Order[i]];
+		if (e->isdir) {	/* The item is a directory */
+			res = f_mkdir(e->dst);	/* Create destination directory */
+			if (res == FR_OK) {
 				if (verbose)
-					printf("Creating: %s\n", DstPath);
-				if (f_mkdir(DstPath)) {	/* Create destination directory */
-					printf("Failed to create directory.\n"); break;
-				}
-				if (!maketree()) break;	/* Enter the directory */
+					printf("Creating: %s\n", e->dst);
 				Dirs++;
+			} else if (res == FR_EXIST) {
+				if (update) Dirs++;	/* Count all directories of the volume */
+			} else {
+				printf("Failed to create directory.\n");
+				rv = 0;
 			}
 		} else {	/* The item is a file */
-			if (verbose)
-				printf("Adding:   %s\n", DstPath);
-			if ((SrcFile = fopen(SrcPath, "rb")) == NULL) {	/* Open source file */
-				printf("Failed to open source file.\n"); break;
-			}
-			if (f_open(&DstFile, DstPath, FA_CREATE_ALWAYS | FA_WRITE)) {	/* Create destination file */
-				printf("Failed to create destination file.\n"); break;
-			}
-			do {	/* Copy source file to destination file */
-				br = fread(Buff, 1, sizeof(Buff), SrcFile);
-				if (br == 0) break;
-				f_write(&DstFile, Buff, (UINT)br, &bw);
-			} while (br == bw);
-			fclose(SrcFile);
-			f_close(&DstFile);
-			if (br && br != bw) {
-				printf("Failed to write file.\n"); break;
-			}
-			Files++;
+			data = pf_get(e->job);
+			rv = update ? updatefile(e, data) : dedupe ? dedupfile(e, data) : copyfile(e, data);
+			pf_release(e->job);
 		}
 	}
-	closedir(pdir);
+
+	pf_stop();
+	return rv;
+}
+
+/* Get the cluster runs of a file of the volume in Clmt, in the format of a
+ * cluster link map table of FatFs: the number of items used, then pairs of
+ * run length and first cluster, terminated by a zero. Returns 0 on error. */
+static int getruns (const char *path)
+{
+	FIL fil;
+	FRESULT res;
+	DWORD *tbl;
+
+	if (f_open(&fil, path, FA_READ)) {
+		printf("Failed to open %s.\n", path);
+		return 0;
+	}
+	for (;;) {
+		if (ClmtLen) {
+			fil.cltbl = Clmt;
+			Clmt[0] = ClmtLen;
+			res = f_lseek(&fil, CREATE_LINKMAP);
+			if (res != FR_NOT_ENOUGH_CORE) break;
+		}
+		ClmtLen = ClmtLen ? Clmt[0] : 64;
+		tbl = realloc(Clmt, ClmtLen * sizeof(DWORD));
+		if (tbl == NULL) {
+			f_close(&fil);
+			printf("Out of memory.\n");
+			return 0;
+		}
+		Clmt = tbl;
+	}
+	f_close(&fil);
+	if (res) {
+		printf("Failed to read the clusters of %s.\n", path);
+		return 0;
+	}
+	return 1;
+}
+
+/* Write the extent index (see INDEX_NAME) with the cluster runs of all files
+ * of the source tree. It's done after all files have been written, so it
+ * always ends up after them in the volume. */
+int writeindex (void)
+{
+	size_t i, j, n, len, pos, max, *ByPath;
+	uint8_t *idx = NULL, *p;
+	UINT bw;
+	int rv = 0;
+
+	printf("Writing extent index...\n");
+
+	ByPath = malloc((TreeLen ? TreeLen : 1) * sizeof(size_t));
+	if (ByPath == NULL) goto nomem;
+	for (i = n = 0; i < TreeLen; i++) {
+		if (!Tree[i].isdir) ByPath[n++] = i;
+	}
+	qsort(ByPath, n, sizeof(size_t), cmpentry);
+
+	max = indexsize(1);
+	idx = malloc(max);
+	if (idx == NULL) goto nomem;
+	memcpy(idx, "FIDX", 4);
+	st_word(idx + 4, INDEX_VERSION);
+	st_word(idx + 6, FF_MIN_SS);
+	st_dword(idx + 8, (DWORD)n);
+	st_dword(idx + 12, FatFs.csize);
+	pos = INDEX_HDR + n * 4;
+
+	for (i = 0; i < n; i++) {
+		const ENTRY *e = &Tree[ByPath[i]];
+
+		if (!getruns(e->dst)) goto end;
+
+		len = strlen(e->dst);
+		if (pos + INDEX_REC + (Clmt[0] - 2) * 4 + len + 4 > max) {
+			max = (pos + INDEX_REC + (Clmt[0] - 2) * 4 + len + 4) * 2;
+			p = realloc(idx, max);
+			if (p == NULL) goto nomem;
+			idx = p;
+		}
+
+		st_dword(idx + INDEX_HDR + i * 4, (DWORD)pos);
+		p = idx + pos;
+		st_dword(p, (Clmt[0] - 2) / 2);
+		st_dword(p + 4, (DWORD)len);
+		st_dword(p + 8, (DWORD)e->size);
+		st_dword(p + 12, (DWORD)((QWORD)e->size >> 32));
+		p += INDEX_REC;
+		for (j = 1; Clmt[j]; j += 2, p += 8) {
+			st_dword(p, FatFs.database + FatFs.csize * (Clmt[j + 1] - 2));
+			st_dword(p + 4, FatFs.csize * Clmt[j]);
+		}
+		memcpy(p, e->dst, len);
+		p += len;
+		do *p++ = 0; while ((p - idx) & 3);	/* Terminator and padding */
+		pos = p - idx;
+	}
+
+	if (f_open(&DstFile, INDEX_NAME, FA_WRITE | FA_CREATE_NEW)) {
+		printf("Failed to create %s. Is it in the source tree?\n", INDEX_NAME);
+		goto end;
+	}
+	if (f_write(&DstFile, idx, (UINT)pos, &bw) || bw != pos) {
+		f_close(&DstFile);
+		printf("Failed to write %s. Volume full?\n", INDEX_NAME);
+		goto end;
+	}
+	if (f_close(&DstFile) || f_chmod(INDEX_NAME, AM_HID | AM_SYS, AM_HID | AM_SYS)) {
+		printf("Failed to write %s.\n", INDEX_NAME);
+		goto end;
+	}
 	rv = 1;
+	goto end;
 
+nomem:
+	printf("Out of memory.\n");
 end:
-	SrcPath[slen] = 0;
-	DstPath[dlen] = 0;
+	free(idx);
+	free(ByPath);
+	return rv;
+}
+
+/* Seconds elapsed since t */
+static double elapsed (const struct timespec *t)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - t->tv_sec) + (now.tv_nsec - t->tv_nsec) / 1e9;
+}
+
+/* Collect the layout statistics of the report from the volume */
+int layoutstats (void)
+{
+	size_t i, j, nruns, ncl;
+
+	for (i = 0; i < TreeLen; i++) {
+		if (Tree[i].isdir) continue;
+		if (!getruns(Tree[i].dst)) return 0;
+		nruns = (Clmt[0] - 2) / 2;
+		for (ncl = 0, j = 1; Clmt[j]; j += 2) ncl += Clmt[j];
+
+		RunHist[nruns < 8 ? nruns : 8]++;
+		if (nruns == 1) ContigBytes += (size_t)Tree[i].size;
+		if (nruns > 1 && verbose)
+			printf("Fragmented: %s (%zu runs)\n", Tree[i].dst, nruns);
+		if (ncl > LongestChain) {
+			LongestChain = ncl;
+			LongestPath = Tree[i].dst;
+		}
+	}
+	return 1;
+}
+
+/* Print the build time, memory usage and layout statistics */
+static void printreport (double total, unsigned int csz)
+{
+	struct rusage ru;
+	size_t i, nfiles = 0, peak = 0;
+	unsigned int c;
+
+	for (i = 1; i < 9; i++) nfiles += RunHist[i];
+	if (getrusage(RUSAGE_SELF, &ru) == 0) {
+#ifdef __APPLE__
+		peak = (size_t)ru.ru_maxrss / 1024;	/* Bytes */
+#else
+		peak = (size_t)ru.ru_maxrss;	/* KiB */
+#endif
+	}
+
+	printf("Report:\n");
+	printf("    Time: %.3f s (scan %.3f s, build %.3f s, output %.3f s)\n",
+			total, ScanTime, BuildTime, total - ScanTime - BuildTime);
+	printf("    Throughput: %.1f MiB/s, %.0f files/s\n",
+			total > 0 ? TotalFilesSize / total / (1024 * 1024) : 0.0,
+			total > 0 ? Files / total : 0.0);
+	printf("    Peak memory: %zu KiB\n", peak);
+	printf("    Files by number of runs (0 = empty):");
+	for (i = 0, c = 0; i < 9; i++) {
+		if (RunHist[i]) printf("%s %zu%s: %zu", c++ ? "," : "", i, i == 8 ? "+" : "", RunHist[i]);
+	}
+	printf("\n    Contiguous files: %.2f%% (%.2f%% of bytes)\n",
+			nfiles ? RunHist[1] * 100.0 / nfiles : 100.0,
+			TotalFilesSize ? ContigBytes * 100.0 / TotalFilesSize : 100.0);
+	if (LongestPath)
+		printf("    Longest cluster chain: %zu clusters (%s)\n", LongestChain, LongestPath);
+	printf("    Slack by cluster size:\n");
+	for (c = 512; c <= (exfat ? 262144U : 65536U); c *= 2) {
+		printf("    %c %6u: %12zu bytes\n", c == csz ? '*' : ' ', c, clustered(c) - TotalFilesSize);
+	}
+}
+
+
+/* Copy a range of a file to the same offset of another file. Blocks of zeros
+ * aren't written, so they stay as holes of the (already sized) output file. */
+static int copyrange (int fin, int fout, off_t pos, off_t end, uint8_t *buf, size_t bufsz)
+{
+	ssize_t rb;
+	size_t n, i;
+
+#ifdef __linux__
+	off_t in_pos = pos, out_pos = pos;
+
+	while (in_pos < end) {	/* Let the kernel copy the data if it can */
+		rb = copy_file_range(fin, &in_pos, fout, &out_pos, (size_t)(end - in_pos), 0);
+		if (rb <= 0) break;
+	}
+	if (in_pos >= end) return 1;
+	pos = in_pos;
+#endif
+
+	while (pos < end) {
+		n = (end - pos < (off_t)bufsz) ? (size_t)(end - pos) : bufsz;
+		rb = pread(fin, buf, n, pos);
+		if (rb <= 0) return 0;
+		for (i = 0; i < (size_t)rb && buf[i] == 0; i++) ;
+		if (i < (size_t)rb && pwrite(fout, buf, (size_t)rb, pos) != rb) return 0;
+		pos += rb;
+	}
+	return 1;
+}
+
+
+/* Copy an existing image to the file that is updated in its place, so that
+ * the original image is left untouched if the update fails (update mode).
+ * Images are usually sparse (see -m), so the copy is a clone of the file if
+ * the filesystem supports it, or a copy of the areas that have data. */
+static int copyimage (const char *src, const char *dst)
+{
+	struct stat st;
+	int fin, fout, ok = 0;
+	off_t pos, data, hole;
+	size_t bufsz = 1024 * 1024;
+	uint8_t *buf = NULL;
+
+	fin = open(src, O_RDONLY);
+	if (fin < 0) return 0;
+	if (fstat(fin, &st) != 0) {
+		close(fin);
+		return 0;
+	}
+	fout = open(dst, O_WRONLY | O_CREAT | O_TRUNC, st.st_mode & 0777);
+	if (fout < 0) {
+		close(fin);
+		return 0;
+	}
+
+#ifdef FICLONE
+	if (ioctl(fout, FICLONE, fin) == 0) {
+		ok = 1;
+		goto end;
+	}
+#endif
+
+	buf = malloc(bufsz);
+	if (buf == NULL || ftruncate(fout, st.st_size) != 0) goto end;
+
+	ok = 1;
+#ifdef SEEK_DATA
+	for (pos = 0; ok && pos < st.st_size; pos = hole) {
+		data = lseek(fin, pos, SEEK_DATA);
+		if (data < 0) {
+			if (pos == 0) ok = copyrange(fin, fout, 0, st.st_size, buf, bufsz);	/* Not supported */
+			break;	/* No more data */
+		}
+		hole = lseek(fin, data, SEEK_HOLE);
+		if (hole < 0) hole = st.st_size;
+		ok = copyrange(fin, fout, data, hole, buf, bufsz);
+	}
+#else
+	(void)pos;
+	(void)data;
+	(void)hole;
+	ok = copyrange(fin, fout, 0, st.st_size, buf, bufsz);
+#endif
+
+end:
+	free(buf);
+	close(fin);
+	if (close(fout)) ok = 0;
+	if (!ok) remove(dst);
+	return ok;
+}
+
+
+/* Remove a partially built output file after an error. In update mode this is
+ * the working copy of the image, never the image itself. */
+static int discard_output (const char *outfile, int mapped, int rv)
+{
+	if (mapped) {
+		disk_unmap_file(0);
+		remove(outfile);
+	}
 	return rv;
 }
 
@@ -187,8 +1282,15 @@ int main (int argc, char* argv[])
 	FILE *fout;
 	size_t wb, szvol;
 	DIRff dir;
-	int ai = 1, truncation = 0;
-	const char *outfile;
+	int ai = 1, truncation = 0, mapped = 0, autocsz;
+	UINT n_root = 1;	/* Default number of root directory entries */
+	const char *outfile, *mapfile;
+	char *workfile = NULL;
+	long ncpu;
+	struct timespec start;
+
+	ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	Threads = (ncpu > 1) ? (unsigned int)ncpu : 0;	/* No point with a single CPU */
 
 	if ((argc == 2) && (strcmp(argv[1], "-V") == 0))
 	{
@@ -202,6 +1304,42 @@ int main (int argc, char* argv[])
 			truncation = 1;
 			ai++;
 			argc--;
+		} else if (!strcmp(argv[ai], "-c")) {
+			contiguous = 1;
+			ai++;
+			argc--;
+		} else if (!strcmp(argv[ai], "-d")) {
+			dedupe = 1;
+			ai++;
+			argc--;
+		} else if (!strcmp(argv[ai], "-i")) {
+			extindex = 1;
+			ai++;
+			argc--;
+		} else if (!strcmp(argv[ai], "-j") && argc >= 3) {
+			Threads = atoi(argv[ai + 1]);
+			ai += 2;
+			argc -= 2;
+		} else if (!strcmp(argv[ai], "-l") && argc >= 3) {
+			Layout = argv[ai + 1];
+			ai += 2;
+			argc -= 2;
+		} else if (!strcmp(argv[ai], "-m")) {
+			mapped = 1;
+			ai++;
+			argc--;
+		} else if (!strcmp(argv[ai], "-r")) {
+			report = 1;
+			ai++;
+			argc--;
+		} else if (!strcmp(argv[ai], "-u")) {
+			update = 1;
+			ai++;
+			argc--;
+		} else if (!strcmp(argv[ai], "-x")) {
+			exfat = 1;
+			ai++;
+			argc--;
 		} else if (!strcmp(argv[ai], "-v")) {
 			verbose = 1;
 			ai++;
@@ -212,33 +1350,120 @@ int main (int argc, char* argv[])
 	}
 
 	if (argc < 3) {
-		printf("usage: mkfatimg [-V] [-t] [-v] <source node> <output image> <image size> [<cluster size>]\n"
+		printf("usage: mkfatimg [-V] [-t] [-c] [-d] [-i] [-j <threads>] [-l <manifest>] [-m] [-r] [-u] [-x] [-v] <source node> <output image> <image size> [<cluster size>]\n"
 				"    -t: Truncate unused area for read only volume.\n"
+				"    -c: Store every file as a single contiguous cluster run.\n"
+				"    -d: Store identical files only once (requires -t).\n"
+				"    -i: Write an index of the sectors of all files to " INDEX_NAME ".\n"
+				"    -j: Number of threads that read source files (0 = none, default: CPUs).\n"
+				"    -l: Place the files listed in <manifest> first, in that order.\n"
+				"    -m: Build the image in place in a memory-mapped (sparse) output file.\n"
+				"    -r: Print build time, memory usage and fragmentation report.\n"
+				"    -u: Update an existing image, only rewriting files that have changed.\n"
+				"    -x: Create an exFAT volume (for big images with big files).\n"
 				"    -v: Verbose mode.\n"
 				"    -V: Print version and exit.\n"
 				"    <source node>: Source node as root of output image\n"
 				"    <output image>: FAT volume image file\n"
 				"    <image size>: Size of output image in unit of sectors (0 = auto, default:0)\n"
-				"    <cluster size>: Size of cluster in unit of byte (default:512)\n"
+				"    <cluster size>: Size of cluster in unit of byte (default:512, exFAT: auto)\n"
+				"                    or 'auto' to select it from the sizes of the files\n"
 			);
 		return 1;
 	}
 
+	if (update && (truncation || Layout)) {
+		printf("-u can't be used with -t or -l.\n");
+		return 1;
+	}
+
+	if (dedupe && !truncation) {
+		printf("-d can only be used with -t.\n");
+		return 1;
+	}
+
+	if (exfat && truncation) {
+		printf("-t can't be used with -x.\n");
+		return 1;
+	}
+
 	const char *SrcPathArg = argv[ai++];
 	outfile = argv[ai++];
+	mapfile = outfile;
 	RamDiskSize = (argc >= 4) ? atoi(argv[ai++]) * 2 : 0;
-	csz = (argc >= 5) ? atoi(argv[ai++]) : 512;
+	csz = (argc >= 5) ? atoi(argv[ai]) : (exfat ? 0 : 512);	/* 0: Selected by f_mkfs() */
+	autocsz = (argc >= 5) && !strcmp(argv[ai++], "auto");
 
+	clock_gettime(CLOCK_MONOTONIC, &start);
 	TotalFilesSize = 0;
-	strcpy(SrcPath, SrcPathArg);
-	treesize();
+	if (snprintf(SrcPath, sizeof SrcPath, "%s", SrcPathArg) >= (int)sizeof SrcPath) {
+		printf("Source path too long.\n");
+		return 1;
+	}
+	if (!treesize(strlen(SrcPath))) return 3;
+	ScanTime = elapsed(&start);
 	printf("Total size of files: %zu bytes\n", TotalFilesSize);
 
-	/* If the user hasn't set the size, use an image size of 40% the total of
-	 * the sizes of all files. */
-	if (RamDiskSize == 0) {
+	if (update) {
+		/* Map the existing image and bring it up to date with the source
+		 * tree. The image size and cluster size arguments are ignored. */
+		workfile = malloc(strlen(outfile) + sizeof ".tmp");
+		if (workfile == NULL) {
+			printf("Not enough memory.\n");
+			return 4;
+		}
+		sprintf(workfile, "%s.tmp", outfile);
+		if (!copyimage(outfile, workfile)) {
+			printf("Failed to copy existing image. Create it without -u first.\n");
+			return 4;
+		}
+		mapfile = workfile;
+		if (!disk_map_file(mapfile, 0)) {
+			remove(mapfile);
+			printf("Failed to map existing image. Create it without -u first.\n");
+			return 4;
+		}
+		mapped = 1;
+		if (f_mount(&FatFs, "", 1)) {
+			printf("Existing image isn't a valid FAT volume.\n");
+			return discard_output(mapfile, mapped, 2);
+		}
+		strcpy(SrcPath, SrcPathArg);
+		DstPath[0] = 0;
+		if (!prunetree()) return discard_output(mapfile, mapped, 3);
+	}
+
+	if (!update && autocsz && (csz = tunecluster(truncation)) == 0) return 2;
+
+	/* exFAT uses big clusters for big volumes. Select it here the same way
+	 * f_mkfs() would, as the size of the volume depends on it. */
+	if (exfat && csz == 0) {
+		csz = 4096;
+		if (clustered(csz) >= 0x80000 * (size_t)FF_MIN_SS) csz = 32768;
+		if (clustered(csz) >= 0x4000000 * (size_t)FF_MIN_SS) csz = 131072;
+	}
+
+	/* If the user hasn't set the size, use an image size of 40% more than the
+	 * total space used by all files. */
+	if (!update && RamDiskSize == 0 && truncation) {
+		/* Size the volume for the source tree from the start instead of
+		 * creating a big volume and truncating the unused area later. Small
+		 * volumes aren't truncated, as FatFs can't mount them. */
+		printf("Planning volume layout...\n");
+		RamDiskSize = planvolume(csz, &n_root);
+		if (RamDiskSize == 0) {
+			printf("Failed to plan volume. Adjust cluster size.\n");
+			return 2;
+		}
+		if (RamDiskSize * FF_MIN_SS < 64 * 1024) {
+			RamDiskSize = 0;
+			n_root = 1;
+			truncation = 0;
+		}
+	}
+	if (!update && RamDiskSize == 0) {
 		printf("Autocalculating size...\n");
-		RamDiskSize = (TotalFilesSize * 140) / 100;
+		RamDiskSize = (clustered(csz) * 140) / 100;
 
 		/* Minimum size for FAT12 */
 		if (RamDiskSize < 64 * 1024) {
@@ -246,28 +1471,43 @@ int main (int argc, char* argv[])
 			truncation = 0;
 		}
 
-		RamDiskSize = (RamDiskSize / csz) + 1; /* Sectors */
+		/* Minimum size for exFAT (4096 sectors) */
+		if (exfat && RamDiskSize < 0x1000 * FF_MIN_SS)
+			RamDiskSize = 0x1000 * FF_MIN_SS;
+
+		RamDiskSize = (RamDiskSize / FF_MIN_SS) + 1; /* Sectors */
+	}
+
+	/* Use the output file itself as RAM disk. Only the sectors written by
+	 * FatFs are touched, so there is no need to keep a copy of the whole
+	 * volume in memory and to write it out at the end. */
+	if (!update && mapped && !disk_map_file(outfile, 1)) {
+		printf("Failed to map output file.\n");
+		return 4;
 	}
 
-	/* Create an FAT volume (Supports only FAT/FAT32). This function can select
-	 * FAT12, FAT16 or FAT32 automatically depending on the image size. */
+	/* Create an FAT volume. This function can select FAT12, FAT16 or FAT32
+	 * automatically depending on the image size. exFAT is only used if it's
+	 * requested explicitly. */
 	MKFS_PARM opt = {
-		.fmt = FM_FAT | FM_FAT32 | FM_SFD,
+		.fmt = exfat ? FM_EXFAT | FM_SFD : FM_FAT | FM_FAT32 | FM_SFD,
 		.n_fat = 1,
 		.align = 0,
-		.n_root = 1,
+		.n_root = n_root,
 		.au_size = csz
 	};
-	if (f_mkfs("", &opt, Buff, sizeof Buff)) {
+	if (!update && f_mkfs("", &opt, Buff, sizeof Buff)) {
 		printf("Failed to create FAT volume. Adjust volume size or cluster size.\n");
-		return 2;
+		return discard_output(mapfile, mapped, 2);
 	}
 
 	/* Copy source directory tree into the FAT volume */
-	f_mount(&FatFs, "", 0);
-	strcpy(SrcPath, SrcPathArg);
-	DstPath[0] = 0;
-	if (!maketree()) return 3;
+	if (!update) f_mount(&FatFs, "", 0);
+	if (!makeorder()) return discard_output(mapfile, mapped, 3);
+	if (!maketree()) return discard_output(mapfile, mapped, 3);
+	if (extindex && !writeindex()) return discard_output(mapfile, mapped, 3);
+	BuildTime = elapsed(&start) - ScanTime;
+	if (report && !layoutstats()) return discard_output(mapfile, mapped, 3);
 
 	/* Right after f_mount() there is no filesystem type information */
 	switch (FatFs.fs_type) {
@@ -280,73 +1520,50 @@ int main (int argc, char* argv[])
 	case FS_FAT32:
 		printf("Using format FAT32");
 		break;
+	case FS_EXFAT:
+		printf("Using format exFAT");
+		break;
 	default:
 		printf("Using format unknown (%d)\n", FatFs.fs_type);
-		return 3;
+		return discard_output(mapfile, mapped, 3);
 	}
 
-	if (!Files) { printf("No file in the source directory."); return 3; }
-	szvol = ld_word(RamDisk + BPB_TotSec16);
-	if (!szvol) szvol = ld_dword(RamDisk + BPB_TotSec32);
+	if (update) {
+		printf("\n%u files added or rewritten, %u unchanged, %u entries removed.", Files, Unchanged, Removed);
+		Files += Unchanged;
+	}
+
+	if (Linked) {
+		printf("\n%u duplicated files share clusters with other files (%zu KiB saved).", Linked, LinkedSize / 1024);
+	}
+
+	if (!Files) {
+		printf("No file in the source directory.");
+		return discard_output(mapfile, mapped, 3);
+	}
+	if (FatFs.fs_type == FS_EXFAT) {
+		szvol = (size_t)ld_qword(RamDisk + BPB_VolLengthEx);
+	} else {
+		szvol = ld_word(RamDisk + BPB_TotSec16);
+		if (!szvol) szvol = ld_dword(RamDisk + BPB_TotSec32);
+	}
 
 	if (truncation) {
 		DWORD ent, nent;
-		DWORD szf, szfp, edf, edfp;
-		DWORD szd, szdp, edd, eddp;
-
-		/* Truncate unused root directory entries */
-		if (FatFs.fs_type != FS_FAT32) {
-			printf("\nTruncating unused root directory area...");
-			for (nent = ent = 0; ent < FatFs.n_rootdir; ent++) {	/* Get number of entries on the root dir */
-				if (RamDisk[FatFs.dirbase * FF_MIN_SS + ent * 32]) nent = ent + 1;
-			}
-			szd = (nent + (FF_MIN_SS / 32 - 1)) / (FF_MIN_SS / 32);
-			szdp = FatFs.n_rootdir / (FF_MIN_SS / 32);
-			if (szd < szdp) {
-				edd = FatFs.dirbase + szd;
-				eddp = FatFs.database;
-				memcpy(RamDisk + (edd * FF_MIN_SS), RamDisk + (eddp * FF_MIN_SS), (szvol - eddp) * FF_MIN_SS);
-				szvol -= szdp - szd;
-				FatFs.database -= szdp - szd;
-				st_word(RamDisk + BPB_RootEntCnt, (WORD)(szd * (FF_MIN_SS / 32)));
-			}
-		}
 
-		/* Truncate unused data area and FAT */
+		/* The FAT and root directory have been sized for the tree already (or
+		 * by the user), so only the free clusters at the end of the data area
+		 * need to be removed. Nothing has to be moved. */
 		printf("\nTruncating unused data area...");
 		f_opendir(&dir, "");
 		for (nent = ent = 2; ent < FatFs.n_fatent; ent++) {	/* Get number of used clusters */
 			if (get_fat(&dir.obj, ent)) nent = ent + 1;
 		}
-		switch (FatFs.fs_type) {
-		case FS_FAT12:
-			szf = (nent * 3 / 2 + (nent & 1) + (FF_MIN_SS - 1)) / FF_MIN_SS;
-			break;
-		case FS_FAT16:
-			szf = (nent * 2 + (FF_MIN_SS - 1)) / FF_MIN_SS;
-			if (nent - 2 < MIN_FAT16) nent = 0;	/* Wrong cluster count for FAT16 */
-			break;
-		default:
-			szf = (nent * 4 + (FF_MIN_SS - 1)) / FF_MIN_SS;
-			if (nent - 2 < MIN_FAT32) nent = 0;	/* Wrong cluster count for FAT32 */
-			break;
-		}
-		if (!nent) {
-			printf("\nAnother FAT sub-type is requierd for truncation. Adjust volume size or cluster size.\n");
-		} else {
-			/* Actually truncate the filesystem image */
-			szfp = ld_word(RamDisk + BPB_FATSz16) * RamDisk[BPB_NumFATs];
-			if (!szfp) szfp = ld_dword(RamDisk + BPB_FATSz32) * RamDisk[BPB_NumFATs];
-			edf = FatFs.fatbase + szf;
-			edfp = (FatFs.fs_type == FS_FAT32) ? FatFs.database : FatFs.dirbase;
-			memcpy(RamDisk + (edf * FF_MIN_SS), RamDisk + (edfp * FF_MIN_SS), (szvol - edfp) * FF_MIN_SS);
-			szvol -= (szfp - szf) + FatFs.csize * (FatFs.n_fatent - nent);
-			if (FatFs.fs_type == FS_FAT32) {
-				st_dword(RamDisk + BPB_FATSz32, szf);
-			} else {
-				st_word(RamDisk + BPB_FATSz16, (WORD)szf);
-			}
-			RamDisk[BPB_NumFATs] = 1;
+		/* Keep enough clusters so that the FAT sub-type doesn't change */
+		if (FatFs.fs_type == FS_FAT16 && nent - 2 < MIN_FAT16) nent = MIN_FAT16 + 2;
+		if (FatFs.fs_type == FS_FAT32 && nent - 2 < MIN_FAT32) nent = MIN_FAT32 + 2;
+		if (nent < FatFs.n_fatent) {
+			szvol = FatFs.database + FatFs.csize * (nent - 2);
 			if (szvol < 0x10000) {
 				st_word(RamDisk + BPB_TotSec16, (WORD)szvol);
 				st_dword(RamDisk + BPB_TotSec32, 0);
@@ -354,26 +1571,45 @@ int main (int argc, char* argv[])
 				st_word(RamDisk + BPB_TotSec16, 0);
 				st_dword(RamDisk + BPB_TotSec32, szvol);
 			}
+			if (FatFs.fs_type == FS_FAT32)	/* Free cluster count unknown */
+				st_dword(RamDisk + ld_word(RamDisk + BPB_FSInfo32) * FF_MIN_SS + FSI_Free_Count, 0xFFFFFFFF);
 		}
 	}
 
 	/* Output the FAT volume to the file */
-	printf("\nWriting output file...");
-	fout = fopen(outfile, "wb");
-	if (fout == NULL) {
-		printf("Failed to create output file.\n");
-		return 4;
-	}
-	szvol *= FF_MIN_SS;
-	wb = fwrite(RamDisk, 1, szvol, fout);
-	fclose(fout);
-	if (szvol != wb) {
-		remove(outfile);
-		printf("Failed to write output file.\n");
-		return 4;
+	if (mapped) {
+		printf("\nFinishing output file...");
+		if (!disk_unmap_file(szvol)) {
+			remove(mapfile);
+			printf("Failed to write output file.\n");
+			return 4;
+		}
+		if (update && rename(mapfile, outfile)) {
+			remove(mapfile);
+			printf("Failed to replace existing image.\n");
+			return 4;
+		}
+		szvol *= FF_MIN_SS;
+	} else {
+		printf("\nWriting output file...");
+		fout = fopen(outfile, "wb");
+		if (fout == NULL) {
+			printf("Failed to create output file.\n");
+			return 4;
+		}
+		szvol *= FF_MIN_SS;
+		wb = fwrite(RamDisk, 1, szvol, fout);
+		fclose(fout);
+		if (szvol != wb) {
+			remove(outfile);
+			printf("Failed to write output file.\n");
+			return 4;
+		}
 	}
 
 	printf("\n%u files and %u directories in the %zuKiB of FAT volume.\n", Files, Dirs, szvol / 1024);
+	if (report) printreport(elapsed(&start), FatFs.csize * FF_MIN_SS);
+	free(workfile);
 
 	return 0;
 }
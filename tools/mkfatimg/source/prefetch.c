@@ -0,0 +1,185 @@
+/*
+/ Copyright (C) 2026, AntonioND, all right reserved.
+/
+/ FatFs module is an open source software. Redistribution and use of FatFs in
+/ source and binary forms, with or without modification, are permitted provided
+/ that the following condition is met:
+/
+/ 1. Redistributions of source code must retain the above copyright notice,
+/    this condition and the following disclaimer.
+/
+/ This software is provided by the copyright holder and contributors "AS IS"
+/ and any warranties related to this software are DISCLAIMED.
+/ The copyright owner or contributors be NOT LIABLE for any damages caused
+/ by use of this software.
+*/
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "prefetch.h"
+
+
+#define PF_PENDING	0	/* Not read yet */
+#define PF_READY	1	/* Contents available in data */
+#define PF_SKIPPED	2	/* Not prefetched (too big, or read error) */
+
+static PFJOB *Jobs;
+static size_t NJobs;
+static size_t Next;			/* Index of the next job to be claimed by a worker */
+static size_t InFlight;		/* Bytes read but not released yet */
+static size_t Budget;		/* Maximum value of InFlight */
+static int Stop;
+
+static pthread_mutex_t Lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t Ready = PTHREAD_COND_INITIALIZER;	/* A job has finished */
+static pthread_cond_t Space = PTHREAD_COND_INITIALIZER;	/* Memory has been released */
+
+static pthread_t *Threads;
+static unsigned int NThreads;
+
+
+/* Read a whole file. Returns NULL if it can't be read or if its size isn't
+ * the expected one. */
+static uint8_t *readfile (const char *path, size_t size)
+{
+	FILE *fp;
+	uint8_t *data;
+
+	fp = fopen(path, "rb");
+	if (fp == NULL) return NULL;
+
+	data = malloc(size ? size : 1);
+	if (data != NULL) {
+		if (fread(data, 1, size, fp) != size || fgetc(fp) != EOF) {
+			free(data);
+			data = NULL;
+		}
+	}
+
+	fclose(fp);
+	return data;
+}
+
+static void *worker (void *arg)
+{
+	PFJOB *job;
+	uint8_t *data;
+
+	(void)arg;
+
+	pthread_mutex_lock(&Lock);
+	for (;;) {
+		/* Wait until the next job fits in the budget. A job is always allowed
+		 * if nothing else is in flight, so the consumer can't get stuck. */
+		while (!Stop && Next < NJobs && InFlight != 0 &&
+				InFlight + Jobs[Next].size > Budget)
+			pthread_cond_wait(&Space, &Lock);
+		if (Stop || Next >= NJobs) break;
+
+		job = &Jobs[Next++];
+		if (job->size > Budget) {	/* The consumer streams big files itself */
+			job->state = PF_SKIPPED;
+			pthread_cond_broadcast(&Ready);
+			continue;
+		}
+		job->charged = 1;
+		InFlight += job->size;
+		pthread_mutex_unlock(&Lock);
+
+		data = readfile(job->path, job->size);
+
+		pthread_mutex_lock(&Lock);
+		job->data = data;
+		job->state = data ? PF_READY : PF_SKIPPED;
+		pthread_cond_broadcast(&Ready);
+	}
+	pthread_mutex_unlock(&Lock);
+
+	return NULL;
+}
+
+
+/* Start reading the jobs in the background. With no threads every job is
+ * skipped and the caller reads all files itself. Returns 0 on error. */
+int pf_start (PFJOB *jobs, size_t njobs, unsigned int nthreads, size_t budget)
+{
+	size_t i;
+
+	Jobs = jobs;
+	NJobs = njobs;
+	Next = 0;
+	InFlight = 0;
+	Budget = budget;
+	Stop = 0;
+
+	for (i = 0; i < njobs; i++) {
+		jobs[i].data = NULL;
+		jobs[i].state = nthreads ? PF_PENDING : PF_SKIPPED;
+		jobs[i].charged = 0;
+	}
+
+	NThreads = 0;
+	if (nthreads == 0) return 1;
+
+	Threads = malloc(nthreads * sizeof(pthread_t));
+	if (Threads == NULL) return 0;
+
+	for (NThreads = 0; NThreads < nthreads; NThreads++) {
+		if (pthread_create(&Threads[NThreads], NULL, worker, NULL)) {
+			pf_stop();
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+/* Wait until a job has been processed. Returns the contents of the file, or
+ * NULL if the caller needs to read the file itself. */
+const uint8_t *pf_get (PFJOB *job)
+{
+	pthread_mutex_lock(&Lock);
+	while (job->state == PF_PENDING)
+		pthread_cond_wait(&Ready, &Lock);
+	pthread_mutex_unlock(&Lock);
+
+	return job->data;
+}
+
+/* Free the memory used by a job that has been consumed */
+void pf_release (PFJOB *job)
+{
+	pthread_mutex_lock(&Lock);
+	free(job->data);
+	job->data = NULL;
+	if (job->charged) {
+		InFlight -= job->size;
+		job->charged = 0;
+		pthread_cond_broadcast(&Space);
+	}
+	pthread_mutex_unlock(&Lock);
+}
+
+/* Stop all workers and free all memory that hasn't been released */
+void pf_stop (void)
+{
+	size_t i;
+
+	pthread_mutex_lock(&Lock);
+	Stop = 1;
+	pthread_cond_broadcast(&Space);
+	pthread_mutex_unlock(&Lock);
+
+	while (NThreads)
+		pthread_join(Threads[--NThreads], NULL);
+	free(Threads);
+	Threads = NULL;
+
+	for (i = 0; i < NJobs; i++) {
+		free(Jobs[i].data);
+		Jobs[i].data = NULL;
+	}
+	NJobs = 0;
+}
@@ -0,0 +1,49 @@
+/*
+/ Copyright (C) 2026, AntonioND, all right reserved.
+/
+/ FatFs module is an open source software. Redistribution and use of FatFs in
+/ source and binary forms, with or without modification, are permitted provided
+/ that the following condition is met:
+/
+/ 1. Redistributions of source code must retain the above copyright notice,
+/    this condition and the following disclaimer.
+/
+/ This software is provided by the copyright holder and contributors "AS IS"
+/ and any warranties related to this software are DISCLAIMED.
+/ The copyright owner or contributors be NOT LIABLE for any damages caused
+/ by use of this software.
+*/
+
+/*--------------------------------------------------------------------------/
+/  Source file prefetcher for mkfatimg
+/---------------------------------------------------------------------------/
+/
+/ A pool of worker threads reads the source files into memory ahead of the
+/ thread that writes them to the FAT volume. Jobs are read in the order of
+/ the array and must be consumed in the same order. Files that don't fit in
+/ the memory budget are skipped, and the caller has to read them itself.
+/
+/----------------------------------------------------------------------------*/
+
+#ifndef _PREFETCH_DEFINED
+#define _PREFETCH_DEFINED
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct {
+	const char *path;	/* Path to the source file */
+	size_t size;		/* Expected size of the file */
+
+	/* Private fields */
+	uint8_t *data;		/* Contents of the file (NULL if not available) */
+	int state;			/* One of PF_* in prefetch.c */
+	int charged;		/* 1 if the size counts towards the memory budget */
+} PFJOB;
+
+int pf_start (PFJOB *jobs, size_t njobs, unsigned int nthreads, size_t budget);
+const uint8_t *pf_get (PFJOB *job);
+void pf_release (PFJOB *job);
+void pf_stop (void);
+
+#endif